@@ -1,13 +1,47 @@
+#ifdef __linux__
+#define _GNU_SOURCE     // memfd_create, and REG_ERR/REG_EFL in ucontext
+#endif
 #include <stdio.h>
 #include <stdint.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/termios.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#ifdef LC3_HOST_MMU
+#include <ucontext.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define LC3_URING       // see CONSOLE RING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+// Hot helpers that must be folded into every dispatch loop using them.
+#if defined(__GNUC__) || defined(__clang__)
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE static inline
+#endif
 
 // REGISTERS
 enum
@@ -74,392 +108,5722 @@ enum
 
 // MEMORY STORAGE
 #define MEMORY_MAX (1 << 16)
-uint16_t memory[MEMORY_MAX];
 
-// REGISTER STORAGE
-uint16_t reg[R_COUNT];
+// MEMORY-MAPPED DEVICES
+// Memory is split into pages of 256 words. Only pages that hold a device
+// register make loads and stores look for a device; instruction fetches
+// never do.
+#define PAGE_BITS 8
+#define PAGE_COUNT (MEMORY_MAX >> PAGE_BITS)
+#define DEVICE_MAX 8
+
+struct vm;
+
+struct device
+{
+    uint16_t first;     // registers first..last, inclusive
+    uint16_t last;
+    // Either may be NULL to leave that direction as plain memory.
+    uint16_t (*read)(struct vm* vm, void* context, uint16_t address);
+    void (*write)(struct vm* vm, void* context, uint16_t address, uint16_t val);
+    void* context;
+};
+
+struct screen;
+struct console_ring;
+
+struct script_key
+{
+    uint64_t delay;     // instructions after the guest read the key before
+    uint8_t key;
+};
+
+// VIRTUAL MACHINE
+// Everything one machine owns, so a process can run any number of them side
+// by side. Engine caches hang off pointers and are only allocated by the
+// engines that use them.
+struct vm
+{
+    uint16_t memory[MEMORY_MAX];    // first: native code uses the vm pointer as memory[]
+    uint16_t reg[R_COUNT];
+    uint16_t cond_result;           // see UPDATE FLAGS
+    int running;
+    uint64_t instr_count;           // instructions retired, reported by --stats
+
+    // DEVICES
+    FILE* input;                    // keyboard
+    FILE* output;                   // display
+    struct termios original_tio;
+    int raw_input;                  // original_tio has to be put back
+    int input_threaded;             // keys come through input_ring, see INPUT THREAD
+    pthread_t input_thread;
+    _Atomic uint32_t input_head;    // bytes ever pushed, written by the input thread only
+    _Atomic uint32_t input_tail;    // bytes ever taken, written by the machine only
+    _Atomic int input_eof;
+    _Atomic int input_stopping;
+    pthread_mutex_t input_lock;     // only to sleep on an empty or full ring
+    pthread_cond_t input_cond;
+    _Atomic uint64_t input_syscalls;    // reported by --stats
+    uint8_t input_ring[4096];
+    struct console_ring* uring;     // keyboard and display go through it, see CONSOLE RING
+    int uring_reading;              // the uring_ fields are under the ring's lock
+    int uring_writing;
+    int uring_eof;
+    uint32_t uring_in_used;
+    uint32_t uring_in_taken;
+    uint8_t uring_in[256];
+    char* uring_out;                // output being written, copied out of the way
+    size_t uring_out_size;
+    size_t uring_out_used;
+    size_t uring_out_done;
+    int uring_hold;                 // a flush only queues, the wait that follows submits
+    char output_buffer[4096];       // see CONSOLE OUTPUT
+    size_t output_used;
+    double output_latency;          // seconds output may sit in the buffer
+    double output_due;              // when the oldest buffered byte has to go
+    uint64_t output_check;          // instr_count at which the engines call output_tick()
+    uint64_t output_syscalls;       // reported by --stats
+    struct screen* screen;          // see VIRTUAL TERMINAL
+    uint64_t idle_last;             // instr_count at the last KBSR poll that found no key
+    uint32_t idle_polls;            // such polls in a row, each a few instructions apart
+    uint32_t idle_stores;           // stores at the last such poll
+    uint16_t idle_reg[8];           // R0-R7 at the last such poll
+    uint16_t idle_flags;            // and the condition flags
+    uint8_t idle_counter;           // 1 + the register counting up through the streak, or 0
+    uint32_t stores;                // guest stores ever, wrapping
+    uint64_t idle_waits;            // times the machine slept instead, reported by --stats
+    struct script_key* script;      // keys come from here instead, see INPUT SCRIPT
+    size_t script_length;
+    size_t script_next;
+    uint64_t script_due;            // instr_count at which script[script_next] comes
+    uint8_t device_page[PAGE_COUNT];    // devices mapped into each page
+    struct device devices[DEVICE_MAX];
+    int device_count;
+
+    // DIRTY PAGES
+    // Every store stamps its page with the current clock. Cloning and
+    // checkpoints bump the clock and remember where they left off, so any
+    // page stamped since is one they have not seen.
+    uint32_t id;                    // unique per machine
+    uint32_t clock;
+    uint32_t page_stamp[PAGE_COUNT];
+    uint32_t parent_id;             // machine this one was last cloned from
+    uint32_t parent_clock;          // and that machine's clock at the time
+    uint32_t clone_clock;           // own clock right after that clone
+    int image_mapped;               // memory[] is a mapped image, see vm_map_image()
+    FILE* checkpoint;               // see vm_checkpoint()
+    uint32_t checkpoint_clock;      // own clock right after the last one
+    double checkpoint_interval;     // seconds between checkpoints at traps
+    double checkpoint_due;
+
+    // CODE CACHES
+    // One bit per word that has been decoded or translated, so mem_write()
+    // only pays for invalidation when a guest stores into code.
+    uint8_t code_map[MEMORY_MAX / 8];
+    struct decoded* decoded;
+    struct block** block_at;
+    struct block* retired_blocks;
+    // Bumped whenever a block is invalidated. Chained links made in an older
+    // epoch may point at a dead block and are dropped before use.
+    uint32_t block_epoch;
+    // Set by every store into translated code; the trace engine drops all of
+    // its traces when it sees this (and it is cheap for everyone else to set).
+    int trace_flush_pending;
+    struct trace** trace_at;
+    struct trace* traces;
+    uint16_t* trace_hot;
+    uint8_t* trace_fails;           // failed recordings; each doubles the threshold
+
+    // X86-64 JIT
+    uint8_t* jit_code;
+    int jit_writable;               // jit_code is RW, not RX; it is never both
+    size_t jit_used;
+    size_t jit_base;                // end of the entry/exit stubs, kept across flushes
+    int jit_overflow;
+    uint32_t jit_epoch;             // block_epoch at the last flush
+    uint32_t jit_generation;        // bumped by every flush
+    uint8_t** jit_entry_at;
+    uint8_t* jit_exit_common;
+    uint8_t* jit_exit_site;         // direct exit that last returned to C
+    uint32_t (*jit_enter)(struct vm* vm, uint8_t* code);
+
+#ifdef LC3_HOST_MMU
+    // HOST MMU
+    struct mmu_entry* mmu_entry;    // where the fault handler finds this machine
+#endif
+
+#ifdef LC3_AOT
+    // AHEAD-OF-TIME RECOMPILED IMAGE
+    uint8_t aot_dead[MEMORY_MAX];   // labels whose code was stored into
+    int aot_hit;                    // the last store went into recompiled code
+    uint64_t aot_native;            // instructions retired by recompiled code
+#endif
+};
+
+#ifdef LC3_HOST_MMU
+void mmu_protect(struct vm* vm, int protect);  // see HOST MMU
+size_t mmu_reach(struct vm* vm, size_t address);
+#endif
+void checkpoint_tick(struct vm* vm);            // see CHECKPOINTS
+
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
 // INPUT BUFFERING
-struct termios original_tio;
+// The terminal belongs to the process; this is the machine that changed it.
+struct vm* terminal_owner = NULL;
+int terminal_fd = -1;
 
-void disable_input_buffering()
+void disable_input_buffering(struct vm* vm)
 {
-    tcgetattr(STDIN_FILENO, &original_tio);
-    struct termios new_tio = original_tio;
+    if (!isatty(fileno(vm->input))) return;     // a file, a pipe or a buffer
+    tcgetattr(fileno(vm->input), &vm->original_tio);
+    struct termios new_tio = vm->original_tio;
     new_tio.c_lflag &= ~ICANON & ~ECHO;
-    tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+    tcsetattr(fileno(vm->input), TCSANOW, &new_tio);
+    vm->raw_input = 1;
+    terminal_fd = fileno(vm->input);
+    terminal_owner = vm;
 }
 
-void restore_input_buffering()
+void restore_input_buffering(struct vm* vm)
 {
-    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+    if (!vm->raw_input) return;
+    tcsetattr(fileno(vm->input), TCSANOW, &vm->original_tio);
+    vm->raw_input = 0;
+    if (terminal_owner == vm) terminal_owner = NULL;
 }
 
-uint16_t check_key()
+uint16_t check_key(struct vm* vm)
 {
+    int fd = fileno(vm->input);
+    if (fd < 0) return 1;   // a buffer (fmemopen()), never waits
     fd_set readfds;
     FD_ZERO(&readfds);
-    FD_SET(STDIN_FILENO, &readfds);
+    FD_SET(fd, &readfds);
 
     struct timeval timeout;
     timeout.tv_sec = 0;
     timeout.tv_usec = 0;
-    return select(1, &readfds, NULL, NULL, &timeout) != 0;
+    atomic_fetch_add_explicit(&vm->input_syscalls, 1, memory_order_relaxed);
+    return select(fd + 1, &readfds, NULL, NULL, &timeout) != 0;
 }
 
-// HANDLE INTERRUPT
-void handle_interrupt(int signal)
+// INPUT THREAD
+// Polling KBSR with check_key() costs a select() per poll, and games poll in
+// tight loops. Instead a thread blocks in read() on the keyboard and pushes
+// what it gets into input_ring, a single-producer/single-consumer ring the
+// machine polls with two loads. The lock is only taken to sleep: by GETC on
+// an empty ring, or by the thread on a full one.
+#define INPUT_RING ((uint32_t)sizeof(((struct vm*)0)->input_ring))
+
+void input_wake(struct vm* vm)
 {
-    restore_input_buffering();
-    printf("\n");
-    exit(-2);
+    pthread_mutex_lock(&vm->input_lock);
+    pthread_cond_broadcast(&vm->input_cond);
+    pthread_mutex_unlock(&vm->input_lock);
 }
 
-// SIGN EXTEND
-uint16_t sign_extend(uint16_t x, int bit_count)
+void* input_main(void* arg)
 {
-    if ((x >> (bit_count - 1)) & 1) 
+    struct vm* vm = arg;
+    int fd = fileno(vm->input);
+    uint8_t buf[256];
+
+    // Only ever cancelled inside read(), never holding the lock.
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    for (;;)
     {
-        x |= (0xFFFF << bit_count);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        ssize_t n = read(fd, buf, sizeof(buf));
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        atomic_fetch_add_explicit(&vm->input_syscalls, 1, memory_order_relaxed);
+        if (n <= 0) break;
+
+        uint32_t head = atomic_load_explicit(&vm->input_head, memory_order_relaxed);
+        for (ssize_t i = 0; i < n; ++i)
+        {
+            if (head - atomic_load_explicit(&vm->input_tail, memory_order_acquire) == INPUT_RING)
+            {
+                atomic_store_explicit(&vm->input_head, head, memory_order_release);
+                pthread_mutex_lock(&vm->input_lock);
+                pthread_cond_broadcast(&vm->input_cond);
+                while (head - atomic_load_explicit(&vm->input_tail, memory_order_acquire) == INPUT_RING
+                       && !atomic_load(&vm->input_stopping))
+                {
+                    pthread_cond_wait(&vm->input_cond, &vm->input_lock);
+                }
+                pthread_mutex_unlock(&vm->input_lock);
+                if (atomic_load(&vm->input_stopping)) return NULL;
+            }
+            vm->input_ring[head % INPUT_RING] = buf[i];
+            ++head;
+        }
+        atomic_store_explicit(&vm->input_head, head, memory_order_release);
+        input_wake(vm);     // no system call unless GETC is asleep
     }
-    return x;
+    atomic_store_explicit(&vm->input_eof, 1, memory_order_release);
+    input_wake(vm);
+    return NULL;
 }
 
-// SWAP
-uint16_t swap16(uint16_t x)
+int input_start(struct vm* vm)
 {
-    return (x << 8) | (x >> 8);
+    if (vm->input_threaded) return 1;
+    pthread_mutex_init(&vm->input_lock, NULL);
+    pthread_cond_init(&vm->input_cond, NULL);
+    if (pthread_create(&vm->input_thread, NULL, input_main, vm) != 0)
+    {
+        pthread_cond_destroy(&vm->input_cond);
+        pthread_mutex_destroy(&vm->input_lock);
+        return 0;
+    }
+    vm->input_threaded = 1;
+    return 1;
 }
 
-// UPDATE FLAGS
-void update_flags(uint16_t r)
+void input_stop(struct vm* vm)
+{
+    if (!vm->input_threaded) return;
+    atomic_store(&vm->input_stopping, 1);
+    input_wake(vm);
+    pthread_cancel(vm->input_thread);
+    pthread_join(vm->input_thread, NULL);
+    pthread_cond_destroy(&vm->input_cond);
+    pthread_mutex_destroy(&vm->input_lock);
+    vm->input_threaded = 0;
+}
+
+// VIRTUAL TERMINAL
+// With --terminal, guest output is not passed through but played onto a
+// model screen, and each flush (a frame: the guest waits for a key, halts,
+// or output_latency runs out) writes only the cells that changed since the
+// last frame, with the shortest cursor moves that reach them. The model
+// knows what terminal games use: printable bytes, \n \r \b \t, and the CSI
+// sequences for moving the cursor (H f A B C D G d), erasing (J K) and
+// attributes (m). Anything else is dropped.
+// A cell is its byte | pen << 8; a pen is fg | bg << 5 | flags << 10, where
+// colours are 0 for the default and 1 + the colour number (0..15) otherwise.
+#define CELL_BLANK ' '
+#define PEN_FG(pen) ((pen) & 0x1F)
+#define PEN_BG(pen) (((pen) >> 5) & 0x1F)
+#define PEN_FLAGS(pen) ((pen) >> 10)
+
+enum { VT_GROUND = 0, VT_ESCAPE, VT_CSI };
+
+struct screen
 {
-    if (reg[r] == 0)
+    int rows;
+    int cols;
+    uint32_t* cells;            // what the guest has drawn
+    uint32_t* shown;            // what the real terminal shows
+    uint32_t* spare;            // shown, while a frame is tried two ways
+    int row;                    // guest cursor; col == cols means a wrap is due
+    int col;
+    uint32_t pen;
+    int state;                  // escape sequence parser
+    int params[16];
+    int param_count;
+    int private_mode;
+    int dirty;                  // something to draw at the next frame
+    int scrolled;               // lines scrolled off the top since the last frame
+    int fresh;                  // the real terminal's contents are unknown
+    int shown_row;              // real cursor, -1 when unknown
+    int shown_col;
+    uint32_t shown_pen;
+    char* out;                  // the frame being rendered
+    size_t out_used;
+    size_t out_size;
+    uint64_t bytes_in;          // reported by --stats
+    uint64_t bytes_out;
+};
+
+struct screen* screen_create(int rows, int cols)
+{
+    struct screen* s = calloc(1, sizeof(struct screen));
+    if (!s) return NULL;
+    s->rows = rows;
+    s->cols = cols;
+    s->cells = malloc(sizeof(uint32_t) * rows * cols);
+    s->shown = malloc(sizeof(uint32_t) * rows * cols);
+    s->spare = malloc(sizeof(uint32_t) * rows * cols);
+    if (!s->cells || !s->shown || !s->spare)
     {
-        reg[R_COND] = FL_ZRO;
+        free(s->cells);
+        free(s->shown);
+        free(s->spare);
+        free(s);
+        return NULL;
     }
-    else if (reg[r] >> 15)      // If left-most bit is 1, indicates negative
+    for (int i = 0; i < rows * cols; ++i)
     {
-        reg[R_COND] = FL_NEG;
+        s->cells[i] = CELL_BLANK;
     }
-    else
+    s->fresh = 1;
+    return s;
+}
+
+void screen_destroy(struct screen* s)
+{
+    if (!s) return;
+    free(s->cells);
+    free(s->shown);
+    free(s->spare);
+    free(s->out);
+    free(s);
+}
+
+void screen_erase(struct screen* s, int from, int to)
+{
+    for (int i = from; i < to; ++i)
     {
-        reg[R_COND] = FL_POS;
+        s->cells[i] = CELL_BLANK;
     }
 }
 
-// READ IMAGE FILE
-void read_image_file(FILE* file)
+void screen_linefeed(struct screen* s)
 {
-    uint16_t origin;    // location for image to be placed
-    fread(&origin, sizeof(origin), 1, file);
-    origin = swap16(origin);
+    if (s->row + 1 < s->rows)
+    {
+        ++s->row;
+        return;
+    }
+    memmove(s->cells, s->cells + s->cols, sizeof(uint32_t) * (s->rows - 1) * s->cols);
+    screen_erase(s, (s->rows - 1) * s->cols, s->rows * s->cols);
+    ++s->scrolled;
+}
 
-    uint16_t max_read = MEMORY_MAX - origin;
-    uint16_t* p = memory + origin;
-    size_t read = fread(p, sizeof(uint16_t), max_read, file);
+int screen_param(struct screen* s, int i, int fallback)
+{
+    return i < s->param_count && s->params[i] ? s->params[i] : fallback;
+}
+
+int screen_clamp(int v, int limit)
+{
+    return v < 0 ? 0 : v >= limit ? limit - 1 : v;
+}
 
-    while (read-- > 0) // to little endian
+void screen_sgr(struct screen* s)
+{
+    if (s->param_count == 0) s->param_count = 1;    // ESC[m is ESC[0m
+    for (int i = 0; i < s->param_count; ++i)
     {
-        *p = swap16(*p);
-        ++p;
+        int p = s->params[i];
+        uint32_t fg = PEN_FG(s->pen);
+        uint32_t bg = PEN_BG(s->pen);
+        uint32_t flags = PEN_FLAGS(s->pen);
+        if (p == 0) fg = bg = flags = 0;
+        else if (p == 1) flags |= 1;
+        else if (p == 2) flags |= 2;
+        else if (p == 4) flags |= 4;
+        else if (p == 5) flags |= 8;
+        else if (p == 7) flags |= 16;
+        else if (p == 22) flags &= ~3u;
+        else if (p == 24) flags &= ~4u;
+        else if (p == 25) flags &= ~8u;
+        else if (p == 27) flags &= ~16u;
+        else if (p >= 30 && p <= 37) fg = 1 + p - 30;
+        else if (p == 39) fg = 0;
+        else if (p >= 40 && p <= 47) bg = 1 + p - 40;
+        else if (p == 49) bg = 0;
+        else if (p >= 90 && p <= 97) fg = 9 + p - 90;
+        else if (p >= 100 && p <= 107) bg = 9 + p - 100;
+        s->pen = fg | bg << 5 | flags << 10;
     }
 }
 
-// READ IMAGE
-int read_image(const char* image_path)
+void screen_csi(struct screen* s, char final)
 {
-    FILE* file = fopen(image_path, "rb");
-    if (!file) return 0;
-    read_image_file(file);
-    fclose(file);
-    return 1;
+    if (s->private_mode) return;
+    if (s->col == s->cols) s->col = s->cols - 1;
+    int here = s->row * s->cols + s->col;
+    switch (final)
+    {
+        case 'H':
+        case 'f':
+            s->row = screen_clamp(screen_param(s, 0, 1) - 1, s->rows);
+            s->col = screen_clamp(screen_param(s, 1, 1) - 1, s->cols);
+            break;
+        case 'A': s->row = screen_clamp(s->row - screen_param(s, 0, 1), s->rows); break;
+        case 'B': s->row = screen_clamp(s->row + screen_param(s, 0, 1), s->rows); break;
+        case 'C': s->col = screen_clamp(s->col + screen_param(s, 0, 1), s->cols); break;
+        case 'D': s->col = screen_clamp(s->col - screen_param(s, 0, 1), s->cols); break;
+        case 'G': s->col = screen_clamp(screen_param(s, 0, 1) - 1, s->cols); break;
+        case 'd': s->row = screen_clamp(screen_param(s, 0, 1) - 1, s->rows); break;
+        case 'J':
+            switch (screen_param(s, 0, 0))
+            {
+                case 0: screen_erase(s, here, s->rows * s->cols); break;
+                case 1: screen_erase(s, 0, here + 1); break;
+                default: screen_erase(s, 0, s->rows * s->cols); break;
+            }
+            break;
+        case 'K':
+            {
+                int line = s->row * s->cols;
+                switch (screen_param(s, 0, 0))
+                {
+                    case 0: screen_erase(s, here, line + s->cols); break;
+                    case 1: screen_erase(s, line, here + 1); break;
+                    default: screen_erase(s, line, line + s->cols); break;
+                }
+            }
+            break;
+        case 'm':
+            screen_sgr(s);
+            break;
+    }
 }
 
-// MEMORY ACCESS
-void mem_write(uint16_t address, uint16_t val)
+void screen_write(struct screen* s, const char* text, size_t n)
 {
-    memory[address] = val;
+    s->bytes_in += n;
+    s->dirty |= n > 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        uint8_t c = text[i];
+        if (s->state == VT_ESCAPE)
+        {
+            s->state = c == '[' ? VT_CSI : VT_GROUND;
+            s->param_count = 0;
+            s->private_mode = 0;
+            continue;
+        }
+        if (s->state == VT_CSI)
+        {
+            if (c >= '0' && c <= '9')
+            {
+                if (s->param_count == 0) s->params[s->param_count++] = 0;
+                int* p = &s->params[s->param_count - 1];
+                if (*p < 10000) *p = *p * 10 + (c - '0');
+            }
+            else if (c == ';')
+            {
+                if (s->param_count == 0) s->params[s->param_count++] = 0;
+                if (s->param_count < 16) s->params[s->param_count++] = 0;
+            }
+            else if (c >= 0x3C && c <= 0x3F)
+            {
+                s->private_mode = 1;
+            }
+            else if (c >= 0x40 && c <= 0x7E)
+            {
+                screen_csi(s, c);
+                s->state = VT_GROUND;
+            }
+            continue;
+        }
+        switch (c)
+        {
+            case 0x1B:
+                s->state = VT_ESCAPE;
+                break;
+            case '\n':      // the tty turns it into \r\n
+                s->col = 0;
+                screen_linefeed(s);
+                break;
+            case '\r':
+                s->col = 0;
+                break;
+            case '\b':
+                if (s->col == s->cols) --s->col;
+                if (s->col > 0) --s->col;
+                break;
+            case '\t':
+                s->col = screen_clamp((s->col / 8 + 1) * 8, s->cols);
+                break;
+            default:
+                if (c < 0x20 || c == 0x7F) break;
+                if (s->col == s->cols)
+                {
+                    s->col = 0;
+                    screen_linefeed(s);
+                }
+                s->cells[s->row * s->cols + s->col++] = c | s->pen << 8;
+        }
+    }
 }
 
-uint16_t mem_read(uint16_t address)
+void screen_emit(struct screen* s, const char* text, size_t n)
 {
-    if (address == MR_KBSR)
+    if (s->out_used + n > s->out_size)
     {
-        if (check_key())
+        size_t size = s->out_size ? s->out_size : 4096;
+        while (size < s->out_used + n) size *= 2;
+        char* grown = realloc(s->out, size);
+        if (!grown) return;
+        s->out = grown;
+        s->out_size = size;
+    }
+    memcpy(s->out + s->out_used, text, n);
+    s->out_used += n;
+}
+
+void screen_pen(struct screen* s, uint32_t pen)
+{
+    if (pen == s->shown_pen) return;
+    char sgr[64];
+    int n = snprintf(sgr, sizeof(sgr), "\x1b[0");
+    static const int flag_sgr[5] = { 1, 2, 4, 5, 7 };
+    for (int f = 0; f < 5; ++f)
+    {
+        if (PEN_FLAGS(pen) & (1 << f)) n += snprintf(sgr + n, sizeof(sgr) - n, ";%d", flag_sgr[f]);
+    }
+    uint32_t fg = PEN_FG(pen);
+    uint32_t bg = PEN_BG(pen);
+    if (fg) n += snprintf(sgr + n, sizeof(sgr) - n, ";%u", fg <= 8 ? 30 + fg - 1 : 90 + fg - 9);
+    if (bg) n += snprintf(sgr + n, sizeof(sgr) - n, ";%u", bg <= 8 ? 40 + bg - 1 : 100 + bg - 9);
+    n += snprintf(sgr + n, sizeof(sgr) - n, "m");
+    screen_emit(s, pen ? sgr : "\x1b[m", pen ? (size_t)n : 3);
+    s->shown_pen = pen;
+}
+
+// Put the real cursor at row, col the cheapest way: redrawing up to four
+// cells already there, \r, \n (which the tty makes \r\n, as the guest
+// expects too), backspaces, a move right, or an absolute move.
+void screen_move(struct screen* s, int row, int col)
+{
+    if (s->shown_row == row && s->shown_col == col) return;
+    char best[32];
+    int best_n = col ? snprintf(best, sizeof(best), "\x1b[%d;%dH", row + 1, col + 1)
+                     : snprintf(best, sizeof(best), "\x1b[%dH", row + 1);
+    char try[32];
+    int n = -1;
+    if (s->shown_row >= 0 && s->shown_col >= 0 && row >= s->shown_row)
+    {
+        uint32_t* line = s->shown + row * s->cols;
+        int down = row - s->shown_row;
+        int redraw = !down && col > s->shown_col && col - s->shown_col <= 4;
+        for (int c = s->shown_col; redraw && c < col; ++c)
         {
-            memory[MR_KBSR] = (1 << 15);
-            memory[MR_KBDR] = getchar();
+            redraw = (line[c] >> 8) == s->shown_pen;
         }
-        else
+        if (redraw)
+        {
+            for (n = 0; s->shown_col + n < col; ++n) try[n] = (char)line[s->shown_col + n];
+        }
+        else if (!down && col < s->shown_col && s->shown_col - col <= 4)
+        {
+            for (n = 0; n < s->shown_col - col; ++n) try[n] = '\b';
+        }
+        else if (!down && col > s->shown_col)
+        {
+            n = snprintf(try, sizeof(try), "\x1b[%dC", col - s->shown_col);
+        }
+        else if (down < 8)
         {
-            memory[MR_KBSR] = 0;
+            n = 0;
+            if (!down) try[n++] = '\r';
+            for (int d = 0; d < down; ++d) try[n++] = '\n';
+            if (col) n += snprintf(try + n, sizeof(try) - n, "\x1b[%dC", col);
         }
     }
-    return memory[address];
+    if (n >= 0 && n < best_n) screen_emit(s, try, n);
+    else screen_emit(s, best, best_n);
+    s->shown_row = row;
+    s->shown_col = col;
 }
 
-// MAIN
-int main(int argc, const char* argv[])
+// Draw the changes since the last frame, scrolling the real terminal up by
+// the given number of lines first. The scroll happens inside a region of
+// exactly rows lines, since the real terminal may be taller (--terminal=
+// COLSxROWS) and a \n on our last row would then only move down; setting
+// and resetting the region both home the cursor.
+void screen_draw(struct screen* s, int scroll)
 {
-    // LOAD ARGUMENT
-    if (argc < 2)
+    if (scroll)
     {
-        printf("./lc3-vm [image-file1] ...\n");
-        exit(2);
+        char region[32];
+        int n = snprintf(region, sizeof(region), "\x1b[1;%dr", s->rows);
+        screen_emit(s, region, n);
+        s->shown_row = s->shown_col = 0;
+        screen_move(s, s->rows - 1, 0);
+        screen_pen(s, 0);
+        for (int i = 0; i < scroll; ++i)
+        {
+            screen_emit(s, "\n", 1);
+        }
+        screen_emit(s, "\x1b[r", 3);
+        s->shown_row = s->shown_col = 0;
+        int kept = (s->rows - scroll) * s->cols;
+        memmove(s->shown, s->shown + scroll * s->cols, sizeof(uint32_t) * kept);
+        for (int i = kept; i < s->rows * s->cols; ++i)
+        {
+            s->shown[i] = CELL_BLANK;
+        }
     }
-    for (int j = 1; j < argc; ++j)
+    for (int r = 0; r < s->rows; ++r)
     {
-        if (!read_image(argv[j]))
+        uint32_t* now = s->cells + r * s->cols;
+        uint32_t* was = s->shown + r * s->cols;
+        if (memcmp(now, was, sizeof(uint32_t) * s->cols) == 0) continue;
+        int end = s->cols;      // a blank tail is one erase
+        while (end > 0 && now[end - 1] == CELL_BLANK) --end;
+        for (int c = 0; c < s->cols; ++c)
         {
-            printf("failed to load image: %s\n", argv[j]);
-            exit(1);
+            if (now[c] == was[c]) continue;
+            screen_move(s, r, c);
+            if (c >= end)
+            {
+                screen_pen(s, 0);
+                screen_emit(s, "\x1b[K", 3);
+                for (int e = c; e < s->cols; ++e) was[e] = CELL_BLANK;
+                break;
+            }
+            screen_pen(s, now[c] >> 8);
+            char ch = (char)now[c];
+            screen_emit(s, &ch, 1);
+            was[c] = now[c];
+            if (++s->shown_col == s->cols) s->shown_row = s->shown_col = -1;   // wrap handling differs
         }
     }
+    screen_move(s, s->row, s->col < s->cols ? s->col : s->cols - 1);
+    screen_pen(s, s->pen);
+}
 
-    // SETUP
-    signal(SIGINT, handle_interrupt);
-    disable_input_buffering();
-
-    reg[R_COND] = FL_ZRO;
-    enum { PC_START = 0x3000 }; // starting position
-    reg[R_PC] = PC_START;       
-
-    int running = 1;
-    while (running)
+// Render the changes since the last frame into s->out. When the guest
+// scrolled, the frame is drawn both with the real terminal scrolled the same
+// way (text that only moved up is not drawn again) and without (a screen
+// redrawn in the same place each time), and the shorter one is kept; both
+// leave the real terminal the same.
+void screen_frame(struct screen* s)
+{
+    s->out_used = 0;
+    if (s->fresh)
     {
-        uint16_t instr = mem_read(reg[R_PC]++);
-        uint16_t op = instr >> 12;
-        
-        switch (op)
+        screen_emit(s, "\x1b[m\x1b[H\x1b[2J", 10);
+        for (int i = 0; i < s->rows * s->cols; ++i)
         {
-            case OP_ADD:
-                {
-                    uint16_t r0 = (instr >> 9) & 0x7;           // destination register
-                    uint16_t r1 = (instr >> 6) & 0x7;           // first operand
-                    uint16_t imm_flag = (instr >> 5) & 0x1;     // immediate indicator
+            s->shown[i] = CELL_BLANK;
+        }
+        s->shown_row = s->shown_col = 0;
+        s->shown_pen = 0;
+        s->fresh = 0;
+    }
+    if (s->scrolled > 0 && s->scrolled < s->rows)
+    {
+        memcpy(s->spare, s->shown, sizeof(uint32_t) * s->rows * s->cols);
+        int row = s->shown_row;
+        int col = s->shown_col;
+        uint32_t pen = s->shown_pen;
+        size_t base = s->out_used;
+        screen_draw(s, 0);
+        size_t plain = s->out_used - base;
 
-                    if (imm_flag)
-                    {
-                        uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-                        reg[r0] = reg[r1] + imm5;
-                    }
-                    else
-                    {
-                        uint16_t r2 = instr & 0x7;
-                        reg[r0] = reg[r1] + reg[r2];
-                    }
-                    update_flags(r0);
-                }
-                break;
+        memcpy(s->shown, s->spare, sizeof(uint32_t) * s->rows * s->cols);
+        s->shown_row = row;
+        s->shown_col = col;
+        s->shown_pen = pen;
+        screen_draw(s, s->scrolled);
+        size_t scrolled = s->out_used - base - plain;
+        if (scrolled < plain) memmove(s->out + base, s->out + base + plain, scrolled);
+        s->out_used = base + (scrolled < plain ? scrolled : plain);
+    }
+    else
+    {
+        screen_draw(s, 0);
+    }
+    s->scrolled = 0;
+    s->bytes_out += s->out_used;
+    s->dirty = 0;
+}
 
-            case OP_AND:
-                {
-                    uint16_t r0 = (instr >> 9) & 0x7;
-                    uint16_t r1 = (instr >> 6) & 0x7;
-                    uint16_t imm_flag = (instr >> 5) & 0x1;
+// CONSOLE RING
+// With --input=uring the keyboard and display go through an io_uring that
+// every machine in the process asking for one shares. Each machine keeps a
+// read outstanding on its input, and a KBSR poll looks for the completion
+// in the ring's memory: no system call, and no thread per machine. Flushed
+// output goes in as a write, and one io_uring_enter() hands the kernel
+// whatever any machine has queued, so a key read and the frame it causes
+// go together. Without io_uring (not Linux, old headers or kernel, or a
+// filter that forbids it) uring_start() fails and the machine keeps the
+// input thread or direct reads.
+// Completions are routed by user_data, the machine's address with the kind
+// of operation in its low bits. Only one thread at a time sleeps in the
+// kernel; the others wait on cond until it has reaped what woke it.
+enum { URING_READ = 0, URING_WRITE, URING_DONE };
+enum { URING_KEY = 0, URING_WRITTEN, URING_QUIET };
 
-                    if (imm_flag)
-                    {
-                        uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-                        reg[r0] = reg[r1] & imm5;
-                    }
-                    else
-                    {
-                        uint16_t r2 = instr & 0x7;
-                        reg[r0] = reg[r1] & reg[r2];
-                    }
-                    update_flags(r0);
-                }
-                break;
-            
-            case OP_NOT:
-                {
-                    uint16_t r0 = (instr >> 9) & 0x7;
-                    uint16_t r1 = (instr >> 6) & 0x7;
+#ifdef LC3_URING
+#define URING_ENTRIES 256
 
-                    reg[r0] = ~reg[r1];
-                    update_flags(r0);
-                }
-                break;
+struct console_ring
+{
+    int fd;
+    int users;                      // machines on it, under console_ring_lock
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int waiting;                    // a thread is asleep in io_uring_enter()
+    unsigned queued;                // SQEs the kernel has not been handed yet
+    unsigned entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_map;
+    size_t sq_map_size;
+    void* cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+};
 
-            case OP_BR:
-                {
-                    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-                    uint16_t cond_flag = (instr >> 9) & 0x7;
+struct console_ring* console_ring = NULL;  // the process's, while any machine uses it
+pthread_mutex_t console_ring_lock = PTHREAD_MUTEX_INITIALIZER;
 
-                    if (cond_flag & reg[R_COND])
-                    {
-                        reg[R_PC] += pc_offset;
-                    }
-                }
-                break;
-            
-            case OP_JMP:
-                {
-                    uint16_t r1 = (instr >> 6) & 0x7;
-                    reg[R_PC] = reg[r1];
-                }
-                break;
+void console_ring_destroy(struct console_ring* r)
+{
+    if (r->sqes) munmap(r->sqes, r->sqes_size);
+    if (r->cq_map && r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_map_size);
+    if (r->sq_map) munmap(r->sq_map, r->sq_map_size);
+    close(r->fd);
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+}
 
-            case OP_JSR:
-                {
-                    uint16_t long_flag = (instr >> 11) & 1;
-                    reg[R_R7] = reg[R_PC];
+// Does the kernel know the operations used here?
+int console_ring_probe(int fd)
+{
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, size);
+    if (!probe) return 0;
+    int ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    const int ops[] = { IORING_OP_READ, IORING_OP_WRITE, IORING_OP_ASYNC_CANCEL };
+    for (int i = 0; ok && i < 3; ++i)
+    {
+        ok = probe->last_op >= ops[i] && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
 
-                    if (long_flag)
-                    {
-                        uint16_t long_pc_offset = sign_extend(instr & 0x7FF, 11);
-                        reg[R_PC] += long_pc_offset;
-                    }
-                    else
-                    {
-                        uint16_t r1 = (instr >> 6) & 0x7;
-                        reg[R_PC] = reg[r1];
-                    }
-                }
-                break;
-            
-            case OP_LD:
-                {
-                    uint16_t r0 = (instr >> 9) & 0x7;
-                    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-                    reg[r0] = mem_read(reg[R_PC] + pc_offset);
-                    update_flags(r0);
-                }
-                break;
+struct console_ring* console_ring_create()
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd < 0) return NULL;
+    struct console_ring* r = calloc(1, sizeof(struct console_ring));
+    if (!r)
+    {
+        close(fd);
+        return NULL;
+    }
+    r->fd = fd;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    // Reads and writes at the file position (-1) need RW_CUR_POS.
+    if (!(p.features & IORING_FEAT_RW_CUR_POS) || !console_ring_probe(fd))
+    {
+        console_ring_destroy(r);
+        return NULL;
+    }
 
-            case OP_LDI:
-                {
-                    uint16_t r0 = (instr >> 9) & 0x7;                       // destination register
-                    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);     // PC offset = 9
-                    reg[r0] = mem_read(mem_read(reg[R_PC] + pc_offset));    // Apply offset to PC and return new address
-                    update_flags(r0);
-                }
-                break;
-            
-            case OP_LDR:
-                {
-                    uint16_t r0 = (instr >> 9) & 0x7;
-                    uint16_t r1 = (instr >> 6) & 0x7;
-                    uint16_t offset = sign_extend(instr & 0x3F, 6);
+    r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && r->cq_map_size > r->sq_map_size) r->sq_map_size = r->cq_map_size;
+    r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) r->sq_map = NULL;
+    r->cq_map = single ? r->sq_map
+                       : mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (r->cq_map == MAP_FAILED) r->cq_map = NULL;
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) r->sqes = NULL;
+    if (!r->sq_map || !r->cq_map || !r->sqes)
+    {
+        console_ring_destroy(r);
+        return NULL;
+    }
 
-                    reg[r0] = mem_read(reg[r1] + offset);
-                    update_flags(r0);
-                }
-                break;
-            
-            case OP_LEA:
-                {
-                    uint16_t r0 = (instr >> 9) & 0x7;
-                    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+    uint8_t* sq = r->sq_map;
+    uint8_t* cq = r->cq_map;
+    r->entries = p.sq_entries;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return r;
+}
 
-                    reg[r0] = reg[R_PC] + pc_offset;
-                    update_flags(r0);
-                }
-                break;
-            
-            case OP_ST:
-                {
-                    uint16_t r0 = (instr >> 9) & 0x7;
-                    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-                    mem_write(reg[R_PC] + pc_offset, reg[r0]);
-                }
-                break;
+// Hand the kernel everything queued, without waiting. Under r->lock;
+// returns whether that took a system call.
+int uring_submit(struct console_ring* r)
+{
+    if (r->queued == 0) return 0;
+    int n = syscall(__NR_io_uring_enter, r->fd, r->queued, 0, 0, NULL, 0);
+    if (n > 0) r->queued -= n;
+    return 1;
+}
 
-            case OP_STI:
-                {
-                    uint16_t r0 = (instr >> 9) & 0x7;
-                    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-                    mem_write(mem_read(reg[R_PC] + pc_offset), reg[r0]);
-                }
-                break;
-            
-            case OP_STR:
-                {
-                    uint16_t r0 = (instr >> 9) & 0x7;
-                    uint16_t r1 = (instr >> 6) & 0x7;
-                    uint16_t offset = sign_extend(instr & 0x3F, 6);
-                    mem_write(reg[r1] + offset, reg[r0]);
-                }
-                break;
+// Under r->lock; returns 0 if the ring is full even after a submit.
+int uring_queue(struct console_ring* r, int op, int fd, void* addr, uint32_t len, uint64_t user_data)
+{
+    unsigned tail = *r->sq_tail;
+    if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == r->entries)
+    {
+        uring_submit(r);
+        if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == r->entries) return 0;
+    }
+    unsigned index = tail & r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    if (op != IORING_OP_ASYNC_CANCEL) sqe->off = (uint64_t)-1;     // the file position, for files
+    sqe->user_data = user_data;
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++r->queued;
+    return 1;
+}
 
-            case OP_TRAP:
-                {
-                    reg[R_R7] = reg[R_PC];
+// Under r->lock. What is left of a short write goes back in.
+void uring_queue_write(struct vm* vm)
+{
+    vm->uring_writing = uring_queue(vm->uring, IORING_OP_WRITE, fileno(vm->output),
+                                    vm->uring_out + vm->uring_out_done,
+                                    (uint32_t)(vm->uring_out_used - vm->uring_out_done),
+                                    (uintptr_t)vm | URING_WRITE);
+    if (!vm->uring_writing) vm->uring_out_done = vm->uring_out_used;    // dropped
+}
 
-                    switch (instr & 0xFF)
-                    {
-                        case TRAP_GETC:
-                            {
-                                reg[R_R0] = (uint16_t)getchar();
-                                update_flags(R_R0);
-                            }
-                            break;
-
-                        case TRAP_OUT:
-                            {
-                                putc((char)reg[R_R0], stdout);
-                                fflush(stdout);
-                            }
-                            break;
-                        
-                        case TRAP_PUTS:
-                            {
-                                uint16_t* c = memory + reg[R_R0];
-                                while (*c)
-                                {
-                                    putc((char)*c, stdout);
-                                    c++;
-                                }
-                                fflush(stdout);
-                            }
-                            break;
-                        
-                        case TRAP_IN:
-                            {
-                                printf("Enter a character: ");
-                                char c = getchar();
-                                putc(c, stdout);
-                                fflush(stdout);
-                                reg[R_R0] = (uint16_t)c;
-                                update_flags(R_R0);
-                            }
-                            break;
-                        
-                        case TRAP_PUTSP:
-                            {
-                                uint16_t* c = memory + reg[R_R0];
-                                while (*c)
-                                {
-                                    char char1 = (*c) & 0xFF;
-                                    putc(char1, stdout);
-                                    char char2 = (*c) >> 8;
-                                    if (char2) putc(char2, stdout);
-                                    ++c;
-                                }
-                                fflush(stdout);
-                            }
-                            break;
-                        
-                        case TRAP_HALT:
-                            {
-                                puts("Shutdown");
-                                fflush(stdout);
-                                running = 0;
-                            }
-                    }
-                }
-                break;
+// Under r->lock: a read goes out once the last one's bytes are taken.
+void uring_arm(struct vm* vm)
+{
+    if (vm->uring_reading || vm->uring_eof || vm->uring_in_taken < vm->uring_in_used) return;
+    vm->uring_reading = uring_queue(vm->uring, IORING_OP_READ, fileno(vm->input), vm->uring_in,
+                                    sizeof(vm->uring_in), (uintptr_t)vm | URING_READ);
+}
 
-            case OP_RES:
-            case OP_RTI:
-            default:        
+// Under r->lock: pass every completion to its machine. While a thread
+// sleeps in the kernel they are only marked done and left for it to take,
+// so it still wakes for them.
+void uring_reap(struct console_ring* r)
+{
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    int passed = 0;
+    for (unsigned i = head; i != tail; ++i)
+    {
+        struct io_uring_cqe* cqe = &r->cqes[i & r->cq_mask];
+        struct vm* vm = (struct vm*)(uintptr_t)(cqe->user_data & ~(uint64_t)3);
+        int res = cqe->res;
+        int kind = cqe->user_data & 3;
+        cqe->user_data = URING_DONE;
+        passed |= kind != URING_DONE;
+        switch (kind)
+        {
+            case URING_READ:
+                vm->uring_reading = 0;
+                if (res > 0)
+                {
+                    vm->uring_in_used = res;
+                    vm->uring_in_taken = 0;
+                }
+                else if (res != -EINTR && res != -EAGAIN && res != -ECANCELED)
                 {
-                    abort();
+                    vm->uring_eof = 1;
                 }
                 break;
+            case URING_WRITE:
+                vm->uring_writing = 0;
+                if (res > 0) vm->uring_out_done += res;
+                else if (res != -EINTR && res != -EAGAIN) vm->uring_out_done = vm->uring_out_used;
+                if (vm->uring_out_done < vm->uring_out_used) uring_queue_write(vm);
+                break;
         }
     }
-    restore_input_buffering();
-}
\ No newline at end of file
+    if (!r->waiting) __atomic_store_n(r->cq_head, tail, __ATOMIC_RELEASE);
+    if (passed) pthread_cond_broadcast(&r->cond);
+}
+
+int uring_done(struct vm* vm, int what)
+{
+    switch (what)
+    {
+        case URING_KEY: return vm->uring_in_taken < vm->uring_in_used || vm->uring_eof;
+        case URING_WRITTEN: return !vm->uring_writing;
+    }
+    return !vm->uring_reading && !vm->uring_writing;
+}
+
+// Sleep until a key has come in, the last write is out, or (URING_QUIET)
+// nothing of this machine's is in flight.
+void uring_await(struct vm* vm, int what)
+{
+    struct console_ring* r = vm->uring;
+    pthread_mutex_lock(&r->lock);
+    for (;;)
+    {
+        uring_reap(r);
+        if (what == URING_KEY) uring_arm(vm);
+        if (uring_done(vm, what)) break;
+        if (r->waiting)
+        {
+            uring_submit(r);        // the sleeper took the count before this was queued
+            pthread_cond_wait(&r->cond, &r->lock);
+            continue;
+        }
+        r->waiting = 1;
+        unsigned n = r->queued;
+        r->queued = 0;
+        pthread_mutex_unlock(&r->lock);
+        int done = syscall(__NR_io_uring_enter, r->fd, n, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (what == URING_KEY) atomic_fetch_add_explicit(&vm->input_syscalls, 1, memory_order_relaxed);
+        else ++vm->output_syscalls;
+        pthread_mutex_lock(&r->lock);
+        if (done < (int)n) r->queued += n - (done < 0 ? 0 : done);
+        r->waiting = 0;
+        uring_reap(r);
+        pthread_cond_broadcast(&r->cond);   // someone else may sleep in the kernel now
+    }
+    pthread_mutex_unlock(&r->lock);
+}
+
+// Put the machine's keyboard and display on the process's ring; returns 0
+// if there is no io_uring here, or the machine's files are not descriptors.
+int uring_start(struct vm* vm)
+{
+    if (vm->uring) return 1;
+    if (fileno(vm->input) < 0 || fileno(vm->output) < 0) return 0;
+    pthread_mutex_lock(&console_ring_lock);
+    if (!console_ring) console_ring = console_ring_create();
+    if (console_ring) ++console_ring->users;
+    vm->uring = console_ring;
+    pthread_mutex_unlock(&console_ring_lock);
+    return vm->uring != NULL;
+}
+
+void uring_stop(struct vm* vm)
+{
+    struct console_ring* r = vm->uring;
+    if (!r) return;
+    pthread_mutex_lock(&r->lock);
+    if (vm->uring_reading)
+    {
+        uring_queue(r, IORING_OP_ASYNC_CANCEL, -1, (void*)((uintptr_t)vm | URING_READ), 0,
+                    (uintptr_t)vm | URING_DONE);
+    }
+    pthread_mutex_unlock(&r->lock);
+    uring_await(vm, URING_QUIET);   // the kernel is done with uring_in and uring_out
+    vm->uring = NULL;
+
+    pthread_mutex_lock(&console_ring_lock);
+    if (--r->users == 0)
+    {
+        console_ring_destroy(r);
+        console_ring = NULL;
+    }
+    pthread_mutex_unlock(&console_ring_lock);
+}
+
+// Is a key (or end of input) waiting? With submit, a new read goes to the
+// kernel, and a file or pipe that has the bytes answers it right away.
+int uring_ready(struct vm* vm, int submit)
+{
+    struct console_ring* r = vm->uring;
+    pthread_mutex_lock(&r->lock);
+    uring_reap(r);
+    uring_arm(vm);
+    int ready = uring_done(vm, URING_KEY);
+    int called = !ready && submit && uring_submit(r);
+    if (called)
+    {
+        uring_reap(r);
+        ready = uring_done(vm, URING_KEY);
+    }
+    pthread_mutex_unlock(&r->lock);
+    if (called) atomic_fetch_add_explicit(&vm->input_syscalls, 1, memory_order_relaxed);
+    return ready;
+}
+
+// Next key, waiting for one if need be; EOF once input has ended.
+int uring_getc(struct vm* vm)
+{
+    uring_await(vm, URING_KEY);
+    struct console_ring* r = vm->uring;
+    pthread_mutex_lock(&r->lock);
+    int c = vm->uring_in_taken < vm->uring_in_used ? vm->uring_in[vm->uring_in_taken++] : EOF;
+    uring_arm(vm);
+    pthread_mutex_unlock(&r->lock);
+    return c;
+}
+
+// Queue n bytes from p, after the machine's last write. Returns 0 if the
+// ring is full, for the caller to write them itself.
+int uring_send(struct vm* vm, const char* p, size_t n)
+{
+    struct console_ring* r = vm->uring;
+    if (n > 0)
+    {
+        uring_await(vm, URING_WRITTEN);
+        fflush(vm->output);     // anything the host printed through stdio goes first
+        if (n > vm->uring_out_size)
+        {
+            char* grown = realloc(vm->uring_out, n);
+            if (!grown) return 0;
+            vm->uring_out = grown;
+            vm->uring_out_size = n;
+        }
+        memcpy(vm->uring_out, p, n);
+        vm->uring_out_used = n;
+        vm->uring_out_done = 0;
+    }
+    pthread_mutex_lock(&r->lock);
+    if (n > 0) uring_queue_write(vm);
+    int queued = n == 0 || vm->uring_writing;
+    if (!vm->uring_hold && uring_submit(r)) ++vm->output_syscalls;
+    pthread_mutex_unlock(&r->lock);
+    return queued;
+}
+#else
+int uring_start(struct vm* vm)
+{
+    (void)vm;
+    return 0;
+}
+
+void uring_stop(struct vm* vm)
+{
+    (void)vm;
+}
+
+// The rest are never called without a ring.
+int uring_ready(struct vm* vm, int submit)
+{
+    (void)vm;
+    (void)submit;
+    return 1;
+}
+
+void uring_await(struct vm* vm, int what)
+{
+    (void)vm;
+    (void)what;
+}
+
+int uring_getc(struct vm* vm)
+{
+    (void)vm;
+    return EOF;
+}
+
+int uring_send(struct vm* vm, const char* p, size_t n)
+{
+    (void)vm;
+    (void)p;
+    (void)n;
+    return 0;
+}
+#endif
+
+// CONSOLE OUTPUT
+// Guest output collects in output_buffer and goes out in one write() when
+// the guest waits for a key, halts, fills the buffer, or output_latency has
+// passed since the oldest byte came in. The clock is read in output_tick(),
+// at traps, at KBSR polls, and from the engines every OUTPUT_CHECK retired
+// instructions while output is waiting: they compare the count with
+// output_check on their jumps, so a guest that prints and then computes
+// for a long time without a trap still gets its output out.
+#define OUTPUT_CHECK 65536
+void output_send(struct vm* vm, const char* p, size_t left)
+{
+    if (vm->uring && uring_send(vm, p, left)) return;
+    fflush(vm->output);     // anything the host printed through stdio goes first
+    int fd = fileno(vm->output);
+    if (fd < 0)
+    {
+        fwrite(p, 1, left, vm->output);
+        fflush(vm->output);
+        ++vm->output_syscalls;
+        return;
+    }
+    while (left > 0)
+    {
+        ssize_t n = write(fd, p, left);
+        ++vm->output_syscalls;
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        p += n;
+        left -= n;
+    }
+}
+
+// With a virtual terminal, a flush is a frame.
+void output_flush(struct vm* vm)
+{
+    struct screen* s = vm->screen;
+    if (s)
+    {
+        screen_write(s, vm->output_buffer, vm->output_used);
+        vm->output_used = 0;
+        if (!s->dirty) return;
+        screen_frame(s);
+        output_send(vm, s->out, s->out_used);
+        return;
+    }
+    if (vm->output_used == 0) return;
+    size_t n = vm->output_used;
+    vm->output_used = 0;
+    output_send(vm, vm->output_buffer, n);
+}
+
+// Empty a full buffer; onto the screen, if any, without making a frame.
+void output_drain(struct vm* vm)
+{
+    if (!vm->screen)
+    {
+        output_flush(vm);
+        return;
+    }
+    screen_write(vm->screen, vm->output_buffer, vm->output_used);
+    vm->output_used = 0;
+}
+
+int output_pending(struct vm* vm)
+{
+    return vm->output_used || (vm->screen && vm->screen->dirty);
+}
+
+// Called from traps, with instr_count current, before output is added.
+void output_start(struct vm* vm)
+{
+    if (output_pending(vm)) return;
+    vm->output_due = now_seconds() + vm->output_latency;
+    vm->output_check = vm->instr_count + OUTPUT_CHECK;
+}
+
+void output_write(struct vm* vm, const char* s, size_t n)
+{
+    output_start(vm);
+    while (n > 0)
+    {
+        if (vm->output_used == sizeof(vm->output_buffer)) output_drain(vm);
+        size_t room = sizeof(vm->output_buffer) - vm->output_used;
+        size_t chunk = n < room ? n : room;
+        memcpy(vm->output_buffer + vm->output_used, s, chunk);
+        vm->output_used += chunk;
+        s += chunk;
+        n -= chunk;
+    }
+}
+
+// Flush if output_latency has run out, and say when to look again.
+void output_tick(struct vm* vm)
+{
+    if (output_pending(vm) && now_seconds() >= vm->output_due) output_flush(vm);
+    vm->output_check = output_pending(vm) ? vm->instr_count + OUTPUT_CHECK : UINT64_MAX;
+}
+
+// For the engines that keep instr_count in the vm.
+ALWAYS_INLINE void output_poll(struct vm* vm)
+{
+    if (vm->instr_count >= vm->output_check) output_tick(vm);
+}
+
+// INPUT SCRIPT
+// Keys with delays counted in retired instructions instead of a keyboard,
+// so a run goes the same way every time. A script is lines of
+//     DELAY KEYS
+// where each of KEYS comes DELAY instructions after the guest read the key
+// before it; KEYS may use \n, \r, \t, \e, \\ and \xNN. Lines starting with #
+// are comments. The guest asking for a key after the last one stops it.
+int script_escape(const char** p)
+{
+    const char* c = *p;
+    *p += 2;
+    switch (c[1])
+    {
+        case 'n': return '\n';
+        case 'r': return '\r';
+        case 't': return '\t';
+        case 'e': return 0x1B;
+        case '\\': return '\\';
+        case 'x':
+            {
+                char hex[3] = { c[2], c[2] ? c[3] : 0, 0 };
+                char* end;
+                long v = strtol(hex, &end, 16);
+                if (end != hex + 2) return -1;
+                *p += 2;
+                return (int)v;
+            }
+    }
+    return -1;
+}
+
+// Replaces the machine's script; returns 0 if the file is missing or bad.
+int vm_load_script(struct vm* vm, const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if (!f) return 0;
+    struct script_key* keys = NULL;
+    size_t length = 0;
+    size_t capacity = 0;
+    int ok = 1;
+    char line[4096];
+    while (ok && fgets(line, sizeof(line), f))
+    {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == '#' || line[0] == 0) continue;
+        char* end;
+        uint64_t delay = strtoull(line, &end, 10);
+        ok = end != line && (*end == ' ' || *end == 0);
+        const char* p = *end ? end + 1 : end;
+        while (ok && *p)
+        {
+            int key = *p == '\\' ? script_escape(&p) : (uint8_t)*p++;
+            if (key < 0) ok = 0;
+            if (ok && length == capacity)
+            {
+                capacity = capacity ? capacity * 2 : 256;
+                struct script_key* grown = realloc(keys, capacity * sizeof(*keys));
+                ok = grown != NULL;
+                if (ok) keys = grown;
+            }
+            if (!ok) break;
+            keys[length].delay = delay;
+            keys[length].key = (uint8_t)key;
+            ++length;
+        }
+    }
+    fclose(f);
+    if (!ok)
+    {
+        free(keys);
+        return 0;
+    }
+    free(vm->script);
+    vm->script = keys;
+    vm->script_length = length;
+    vm->script_next = 0;
+    vm->script_due = vm->instr_count + (length ? keys[0].delay : 0);
+    return 1;
+}
+
+int script_ready(struct vm* vm)
+{
+    return vm->script_next == vm->script_length || vm->instr_count >= vm->script_due;
+}
+
+// The next key, early if the guest would block for it.
+int script_getc(struct vm* vm)
+{
+    output_flush(vm);       // the guest waits for this key, as far as it knows
+    if (vm->script_next == vm->script_length)
+    {
+        vm->running = 0;    // engines stop at the next trap, which GETC and IN are
+        return EOF;
+    }
+    int key = vm->script[vm->script_next++].key;
+    if (vm->script_next < vm->script_length)
+    {
+        vm->script_due = vm->instr_count + vm->script[vm->script_next].delay;
+    }
+    return key;
+}
+
+// Is a key (or end of input) waiting? Never a system call with the thread.
+int input_ready(struct vm* vm)
+{
+    if (vm->script) return script_ready(vm);
+    if (vm->uring)
+    {
+        // Output that is due goes to the kernel in the same system call as
+        // the new read.
+        if (uring_ready(vm, 0)) return 1;
+        output_tick(vm);
+        return uring_ready(vm, 1);
+    }
+    if (!vm->input_threaded) return check_key(vm);
+    return atomic_load_explicit(&vm->input_head, memory_order_acquire)
+               != atomic_load_explicit(&vm->input_tail, memory_order_relaxed)
+           || atomic_load_explicit(&vm->input_eof, memory_order_acquire);
+}
+
+// Sleep until input_ready() would say yes.
+void input_wait(struct vm* vm)
+{
+    if (vm->uring)
+    {
+        uring_await(vm, URING_KEY);
+        return;
+    }
+    if (!vm->input_threaded)
+    {
+        struct pollfd p = { fileno(vm->input), POLLIN, 0 };
+        atomic_fetch_add_explicit(&vm->input_syscalls, 1, memory_order_relaxed);
+        while (p.fd >= 0 && poll(&p, 1, -1) < 0 && errno == EINTR)
+        {
+        }
+        return;
+    }
+    pthread_mutex_lock(&vm->input_lock);
+    while (!input_ready(vm))
+    {
+        pthread_cond_wait(&vm->input_cond, &vm->input_lock);
+    }
+    pthread_mutex_unlock(&vm->input_lock);
+}
+
+// Next key, waiting for one if need be; EOF once input has ended.
+int input_getc(struct vm* vm)
+{
+    if (vm->script) return script_getc(vm);
+    if (vm->uring)
+    {
+        // The output goes in with the wait for the key, in one system call.
+        if (!uring_ready(vm, 0))
+        {
+            vm->uring_hold = 1;
+            output_flush(vm);
+            vm->uring_hold = 0;
+        }
+        return uring_getc(vm);
+    }
+    if (!vm->input_threaded)
+    {
+        output_flush(vm);
+        atomic_fetch_add_explicit(&vm->input_syscalls, 1, memory_order_relaxed);
+        // Straight from the descriptor: a key hidden in a stdio buffer
+        // would be invisible to check_key() and input_wait().
+        int fd = fileno(vm->input);
+        if (fd < 0) return getc(vm->input);
+        uint8_t c;
+        ssize_t n;
+        while ((n = read(fd, &c, 1)) < 0 && errno == EINTR)
+        {
+        }
+        return n == 1 ? c : EOF;
+    }
+
+    uint32_t tail = atomic_load_explicit(&vm->input_tail, memory_order_relaxed);
+    if (atomic_load_explicit(&vm->input_head, memory_order_acquire) == tail)
+    {
+        output_flush(vm);
+        pthread_mutex_lock(&vm->input_lock);
+        while (atomic_load_explicit(&vm->input_head, memory_order_acquire) == tail
+               && !atomic_load_explicit(&vm->input_eof, memory_order_acquire))
+        {
+            pthread_cond_wait(&vm->input_cond, &vm->input_lock);
+        }
+        pthread_mutex_unlock(&vm->input_lock);
+        if (atomic_load_explicit(&vm->input_head, memory_order_acquire) == tail) return EOF;
+    }
+
+    uint32_t head = atomic_load_explicit(&vm->input_head, memory_order_relaxed);
+    uint8_t c = vm->input_ring[tail % INPUT_RING];
+    atomic_store_explicit(&vm->input_tail, tail + 1, memory_order_release);
+    if (head - tail == INPUT_RING) input_wake(vm);     // the thread may be waiting for room
+    return c;
+}
+
+// HANDLE INTERRUPT
+// Only async-signal-safe calls: whatever was interrupted may be halfway
+// through the output buffer, the screen or the ring, so output still
+// buffered is dropped and the terminal just gets its settings back.
+void handle_interrupt(int signal)
+{
+    (void)signal;
+    struct vm* vm = terminal_owner;
+    if (vm) tcsetattr(terminal_fd, TCSANOW, &vm->original_tio);
+    ssize_t written = write(STDOUT_FILENO, "\n", 1);
+    (void)written;
+    _exit(-2);
+}
+
+// SIGN EXTEND
+uint16_t sign_extend(uint16_t x, int bit_count)
+{
+    if ((x >> (bit_count - 1)) & 1) 
+    {
+        x |= (0xFFFF << bit_count);
+    }
+    return x;
+}
+
+// SWAP
+uint16_t swap16(uint16_t x)
+{
+    return (x << 8) | (x >> 8);
+}
+
+// Byte swap n words from src to dst, which may be the same buffer. A vector
+// at a time where the host has them (a 16-bit byte swap is just two shifts,
+// so SSE2 is enough), then word by word.
+void swap_words(uint16_t* dst, const uint16_t* src, size_t n)
+{
+    size_t i = 0;
+#ifdef __AVX2__
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(src + i));
+        x = _mm256_or_si256(_mm256_slli_epi16(x, 8), _mm256_srli_epi16(x, 8));
+        _mm256_storeu_si256((__m256i*)(dst + i), x);
+    }
+#endif
+#ifdef __SSE2__
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+        x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+        _mm_storeu_si128((__m128i*)(dst + i), x);
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        dst[i] = swap16(src[i]);
+    }
+}
+
+// STRING OUTPUT
+// PUTS prints the low byte of each word up to a zero word; PUTSP prints the
+// low byte and then the high byte, unless it is zero. Both go straight into
+// the console buffer a vector at a time: PUTS narrows 16 words to 16 bytes,
+// and 8 PUTSP words with no zero high byte are already their 16 bytes in
+// memory order. Anything else, and the tail, goes word by word.
+
+// Narrow src[0..n) into dst up to the first zero word; returns the words done.
+size_t narrow_words(char* dst, const uint16_t* src, size_t n)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i low = _mm_set1_epi16(0xFF);
+#endif
+    while (i < n && src[i])
+    {
+#ifdef __SSE2__
+        if (i + 16 <= n)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(src + i + 8));
+            __m128i ends = _mm_or_si128(_mm_cmpeq_epi16(a, zero), _mm_cmpeq_epi16(b, zero));
+            if (!_mm_movemask_epi8(ends))
+            {
+                __m128i bytes = _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low));
+                _mm_storeu_si128((__m128i*)(dst + i), bytes);
+                i += 16;
+                continue;
+            }
+        }
+#endif
+        dst[i] = (char)src[i];
+        ++i;
+    }
+    return i;
+}
+
+// Unpack src[0..n) into dst up to the first zero word; returns the words
+// done and leaves the bytes written in *out.
+size_t unpack_words(char* dst, const uint16_t* src, size_t n, size_t* out)
+{
+    size_t i = 0;
+    size_t o = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i high = _mm_set1_epi16((short)0xFF00);
+#endif
+    while (i < n && src[i])
+    {
+#ifdef __SSE2__
+        if (i + 8 <= n)
+        {
+            __m128i w = _mm_loadu_si128((const __m128i*)(src + i));
+            if (!_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(w, high), zero)))
+            {
+                _mm_storeu_si128((__m128i*)(dst + o), w);     // SSE2 hosts are little-endian
+                i += 8;
+                o += 16;
+                continue;
+            }
+        }
+#endif
+        dst[o++] = src[i] & 0xFF;
+        if (src[i] >> 8) dst[o++] = src[i] >> 8;
+        ++i;
+    }
+    *out = o;
+    return i;
+}
+
+// The string at address, wrapping from 0xFFFF to 0x0000, and given up after
+// one lap of memory without a zero word.
+void output_string(struct vm* vm, uint16_t address, int packed)
+{
+    output_start(vm);
+    size_t left = MEMORY_MAX;
+#ifdef LC3_HOST_MMU
+    // Like the other engines, read the words under a device as memory; only
+    // a string that gets there pays for opening the pages.
+    int opened = 0;
+#endif
+    while (left > 0)
+    {
+        if (sizeof(vm->output_buffer) - vm->output_used < 32) output_drain(vm);
+        size_t room = sizeof(vm->output_buffer) - vm->output_used;
+        size_t n = MEMORY_MAX - address;
+        if (n > left) n = left;
+        if (n > (packed ? room / 2 : room)) n = packed ? room / 2 : room;
+#ifdef LC3_HOST_MMU
+        if (!opened)
+        {
+            size_t reach = mmu_reach(vm, address);
+            if (reach == 0)
+            {
+                mmu_protect(vm, 0);
+                opened = 1;
+            }
+            else if (n > reach)
+            {
+                n = reach;
+            }
+        }
+#endif
+
+        char* dst = vm->output_buffer + vm->output_used;
+        const uint16_t* src = vm->memory + address;
+        size_t bytes;
+        size_t done = packed ? unpack_words(dst, src, n, &bytes) : (bytes = narrow_words(dst, src, n));
+        vm->output_used += bytes;
+        if (done < n) break;    // stopped at the zero word
+        address += done;        // wraps to 0
+        left -= done;
+    }
+#ifdef LC3_HOST_MMU
+    if (opened) mmu_protect(vm, 1);
+#endif
+}
+
+// UPDATE FLAGS
+// Flag-setting instructions only record their result; N/Z/P are worked out
+// when something actually reads them (BR, traps, a snapshot of reg[]).
+void update_flags(struct vm* vm, uint16_t r)
+{
+    vm->cond_result = vm->reg[r];
+}
+
+uint16_t result_flags(uint16_t result)
+{
+    // zero shifts FL_POS to FL_ZRO, a set sign bit shifts it to FL_NEG
+    return FL_POS << ((result == 0) + ((result >> 15) << 1));
+}
+
+uint16_t cond_flags(struct vm* vm)
+{
+    return result_flags(vm->cond_result);
+}
+
+// Copy the flags into reg[R_COND], or take them back from it.
+void materialize_flags(struct vm* vm)
+{
+    vm->reg[R_COND] = cond_flags(vm);
+}
+
+void load_flags(struct vm* vm)
+{
+    vm->cond_result = vm->reg[R_COND] & FL_NEG ? 0x8000 : vm->reg[R_COND] & FL_ZRO ? 0 : 1;
+}
+
+// READ IMAGE FILE
+// Big-endian words go to memory[origin...], cut off at the end of memory.
+void place_image(struct vm* vm, uint16_t origin, const uint16_t* words, size_t count)
+{
+    if (count > (size_t)(MEMORY_MAX - origin)) count = MEMORY_MAX - origin;
+    swap_words(vm->memory + origin, words, count);
+    for (size_t a = origin; a < origin + count; a += 1 << PAGE_BITS)
+    {
+        vm->page_stamp[a >> PAGE_BITS] = vm->clock;
+    }
+    if (count) vm->page_stamp[(origin + count - 1) >> PAGE_BITS] = vm->clock;
+}
+
+void load_image_file(struct vm* vm, FILE* file)
+{
+    uint16_t origin;    // location for image to be placed
+    if (fread(&origin, sizeof(origin), 1, file) != 1) return;
+    origin = swap16(origin);
+
+    size_t max_read = MEMORY_MAX - origin;
+    uint16_t* p = vm->memory + origin;
+    size_t read = fread(p, sizeof(uint16_t), max_read, file);
+    place_image(vm, origin, p, read);   // to little endian
+}
+
+// The load_ functions leave device pages to the caller: read() into a
+// PROT_NONE page fails instead of faulting.
+void read_image_file(struct vm* vm, FILE* file)
+{
+#ifdef LC3_HOST_MMU
+    mmu_protect(vm, 0);
+#endif
+    load_image_file(vm, file);
+#ifdef LC3_HOST_MMU
+    mmu_protect(vm, 1);
+#endif
+}
+
+// READ IMAGE
+// read() straight into memory and swap in place: no stdio buffer and no
+// copy in between. (Mapping the file instead measured slower for every image
+// size up to a full 128 KB, since the page faults cost more than the copy.)
+int load_image(struct vm* vm, const char* image_path)
+{
+    int fd = open(image_path, O_RDONLY);
+    if (fd < 0) return 0;
+
+    uint16_t origin;
+    if (read(fd, &origin, sizeof(origin)) == sizeof(origin))
+    {
+        origin = swap16(origin);
+        uint16_t* p = vm->memory + origin;
+        size_t max_read = (MEMORY_MAX - origin) * sizeof(uint16_t);
+        size_t got = 0;
+        ssize_t n;
+        while (got < max_read && (n = read(fd, (char*)p + got, max_read - got)) > 0) got += n;
+        place_image(vm, origin, p, got / sizeof(uint16_t));
+    }
+    close(fd);
+    return 1;
+}
+
+// Load images in order in one pass, later ones on top. Returns how many
+// loaded; a short count means images[count] failed.
+int read_images(struct vm* vm, const char* const* images, int count)
+{
+    int loaded = 0;
+#ifdef LC3_HOST_MMU
+    mmu_protect(vm, 0);
+#endif
+    while (loaded < count && load_image(vm, images[loaded])) ++loaded;
+#ifdef LC3_HOST_MMU
+    mmu_protect(vm, 1);
+#endif
+    return loaded;
+}
+
+int read_image(struct vm* vm, const char* image_path)
+{
+    return read_images(vm, &image_path, 1) == 1;
+}
+
+// DECODED INSTRUCTION CACHE
+// Handler ids for pre-decoded instructions. H_DECODE is zero so a cleared
+// slot means "decode on next execution".
+enum
+{
+    H_DECODE = 0,
+    H_BR,
+    H_ADD_REG,
+    H_ADD_IMM,
+    H_AND_REG,
+    H_AND_IMM,
+    H_NOT,
+    H_LD,
+    H_LDI,
+    H_LDR,
+    H_LEA,
+    H_ST,
+    H_STI,
+    H_STR,
+    H_JMP,
+    H_JSR,
+    H_JSRR,
+    H_TRAP,
+    H_BAD,
+    H_COUNT
+};
+
+const char* handler_names[H_COUNT] =
+{
+    "DECODE", "BR", "ADD_REG", "ADD_IMM", "AND_REG", "AND_IMM", "NOT", "LD",
+    "LDI", "LDR", "LEA", "ST", "STI", "STR", "JMP", "JSR", "JSRR", "TRAP", "BAD"
+};
+
+// SUPERINSTRUCTIONS
+// Adjacent handler pairs that run_decoded() executes in one dispatch. This is
+// the output of tools/fused-pairs.sh, which runs --engine=profile over
+// 2048.script and rogue.script and merges the two lists by weight (the sum
+// of a pair's shares). Comments give each pair's share of sequential pairs
+// in 2048 / rogue ("-" when outside that game's top list). Regenerate it
+// with the script rather than editing by hand.
+#define FUSED_PAIRS(X) \
+    X(ADD_REG, BR)      /* 41.6% /  4.0% */ \
+    X(ADD_IMM, ADD_REG) /* 40.9% /   -   */ \
+    X(ADD_IMM, BR)      /*  0.9% / 20.4% */ \
+    X(ADD_REG, LDR)     /*  0.6% /  9.8% */ \
+    X(ADD_REG, ADD_IMM) /*   -   / 10.3% */ \
+    X(LDR, TRAP)        /*  0.4% /  9.8% */ \
+    X(LEA, ADD_REG)     /*   -   /  9.8% */ \
+    X(LDR, LEA)         /*   -   /  9.8% */ \
+    X(ADD_IMM, ADD_IMM) /*   -   /  9.8% */ \
+    X(ADD_REG, ADD_REG) /*  1.0% /  3.8% */
+
+enum
+{
+    F_BEFORE = H_COUNT - 1,
+#define FUSED_ENUM(a, b) F_##a##_##b,
+    FUSED_PAIRS(FUSED_ENUM)
+#undef FUSED_ENUM
+    F_END
+};
+
+// fusion_table[first][second] is the fused handler for the pair, or 0.
+const uint8_t fusion_table[H_COUNT][H_COUNT] =
+{
+#define FUSED_ENTRY(a, b) [H_##a][H_##b] = F_##a##_##b,
+    FUSED_PAIRS(FUSED_ENTRY)
+#undef FUSED_ENTRY
+};
+
+struct decoded
+{
+    uint8_t handler;
+    uint8_t base;   // handler before fusion with the next word
+    uint8_t r0;     // DR, SR for stores, or nzp mask for BR
+    uint8_t r1;     // SR1 or BaseR
+    uint8_t r2;     // SR2
+    uint16_t imm;   // sign-extended immediate/offset, or trap vector
+};
+
+
+// BASIC BLOCK CACHE
+// Micro-ops for translated blocks. PC-relative operands are resolved to
+// absolute addresses at translation time; the last op of a block is always
+// one of the exits from U_BR on.
+enum
+{
+    U_ADD_REG = 0,
+    U_ADD_IMM,
+    U_AND_REG,
+    U_AND_IMM,
+    U_NOT,
+    U_LD,
+    U_LDI,
+    U_LDR,
+    U_LEA,
+    U_ST,
+    U_STI,
+    U_STR,
+    U_BR,       // exits
+    U_JMP,
+    U_JSR,
+    U_JSRR,
+    U_TRAP,
+    U_BAD,
+    U_END,      // block hit BLOCK_MAX; continue at the next address
+    U_COUNT
+};
+
+#define BLOCK_MAX 64    // longest block, also bounds the invalidation scan
+
+struct uop
+{
+    uint8_t kind;
+    uint8_t r0;
+    uint8_t r1;
+    uint8_t r2;
+    uint16_t imm;   // immediate, absolute address/target, or trap vector
+};
+
+struct block
+{
+    uint16_t start;
+    uint16_t length;            // guest instructions covered
+    uint32_t epoch;             // block_epoch the links below were made in
+    struct block* taken;        // successor at the branch/jump target
+    struct block* fallthrough;  // successor at start + length
+    struct block* retired;      // next on the free-later list
+    struct uop ops[];
+};
+
+void invalidate_blocks(struct vm* vm, uint16_t address)
+{
+    if (!vm->block_at) return;
+    for (int i = 0; i < BLOCK_MAX; ++i)
+    {
+        uint16_t start = address - i;
+        struct block* b = vm->block_at[start];
+        if (b && (uint16_t)(address - start) < b->length)
+        {
+            // The block may be the one executing the store, so free it
+            // only once the engine is back in the dispatcher.
+            vm->block_at[start] = NULL;
+            b->retired = vm->retired_blocks;
+            vm->retired_blocks = b;
+            ++vm->block_epoch;
+        }
+    }
+}
+
+#ifdef LC3_AOT
+void aot_invalidate(struct vm* vm, uint16_t address);  // see AHEAD-OF-TIME RECOMPILER
+#endif
+
+void invalidate_code(struct vm* vm, uint16_t address)
+{
+    vm->code_map[address >> 3] &= ~(1 << (address & 7));
+    if (vm->decoded)
+    {
+        vm->decoded[address].handler = H_DECODE;
+        vm->decoded[address].base = H_DECODE;
+
+        // Undo any superinstruction the previous word formed with this one.
+        struct decoded* prev = &vm->decoded[(uint16_t)(address - 1)];
+        prev->handler = prev->base;
+    }
+    invalidate_blocks(vm, address);
+    vm->trace_flush_pending = 1;
+#ifdef LC3_AOT
+    aot_invalidate(vm, address);
+#endif
+}
+
+// MEMORY ACCESS
+// Map a device over first..last. Compiled code checks the page of constant
+// addresses when it is generated, so map devices before running. Returns 0
+// when the device table is full.
+int vm_map_device(struct vm* vm, uint16_t first, uint16_t last,
+    uint16_t (*read)(struct vm* vm, void* context, uint16_t address),
+    void (*write)(struct vm* vm, void* context, uint16_t address, uint16_t val),
+    void* context)
+{
+    if (vm->device_count == DEVICE_MAX || last < first) return 0;
+    struct device* d = &vm->devices[vm->device_count++];
+    d->first = first;
+    d->last = last;
+    d->read = read;
+    d->write = write;
+    d->context = context;
+    for (int page = first >> PAGE_BITS; page <= last >> PAGE_BITS; ++page)
+    {
+        ++vm->device_page[page];
+    }
+#ifdef LC3_HOST_MMU
+    mmu_protect(vm, 1);
+#endif
+    return 1;
+}
+
+// Slow paths for pages with a device on them.
+uint16_t device_read(struct vm* vm, uint16_t address)
+{
+    for (int i = 0; i < vm->device_count; ++i)
+    {
+        struct device* d = &vm->devices[i];
+        if (d->read && address >= d->first && address <= d->last)
+        {
+            return d->read(vm, d->context, address);
+        }
+    }
+    return vm->memory[address];
+}
+
+int device_write(struct vm* vm, uint16_t address, uint16_t val)
+{
+    for (int i = 0; i < vm->device_count; ++i)
+    {
+        struct device* d = &vm->devices[i];
+        if (d->write && address >= d->first && address <= d->last)
+        {
+            d->write(vm, d->context, address, val);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// With LC3_HOST_MMU device pages are not accessible to the host, so these
+// are plain loads and stores and devices are reached through the fault
+// handler (see HOST MMU). volatile keeps each guest access a real one.
+void mem_write(struct vm* vm, uint16_t address, uint16_t val)
+{
+#ifdef LC3_HOST_MMU
+    *(volatile uint16_t*)&vm->memory[address] = val;
+#else
+    if (vm->device_page[address >> PAGE_BITS] && device_write(vm, address, val)) return;
+    vm->memory[address] = val;
+#endif
+    vm->page_stamp[address >> PAGE_BITS] = vm->clock;
+    ++vm->stores;
+    if (vm->code_map[address >> 3] & (1 << (address & 7)))
+    {
+        invalidate_code(vm, address);
+    }
+}
+
+uint16_t mem_read(struct vm* vm, uint16_t address)
+{
+#ifdef LC3_HOST_MMU
+    return *(volatile uint16_t*)&vm->memory[address];
+#else
+    if (vm->device_page[address >> PAGE_BITS]) return device_read(vm, address);
+    return vm->memory[address];
+#endif
+}
+
+// Instruction fetch: code is never a device register.
+ALWAYS_INLINE uint16_t mem_fetch(struct vm* vm, uint16_t address)
+{
+    return vm->memory[address];
+}
+
+// HOST MMU
+// Build with -DLC3_HOST_MMU (Linux, x86-64) to have the host MMU find device
+// accesses instead of mem_read()/mem_write(). The machine is mmap()ed, so
+// memory[] starts on a host page, and every host page holding a device
+// register is PROT_NONE. A host page is 2048 words, so the words sharing it
+// with the devices take the same (slow, correct) path.
+//
+// The signal handlers only open and close pages and edit the interrupted
+// context; the device itself is called from mmu_service(), in the thread's
+// normal context, where it may lock, poll, print and sleep like any other
+// code. An access there goes:
+//     load:  SIGSEGV opens the page and sends the thread into mmu_service(),
+//            which reads the device into memory[] and traps back with int3.
+//            SIGTRAP restores the faulting context with the trap flag set,
+//            the load runs once, and the trap flag's SIGTRAP closes the page.
+//     store: SIGSEGV opens the page and single-steps the store. Its SIGTRAP
+//            sends the thread into mmu_service() to hand the stored word to
+//            the device, and the int3 after that restores the context and
+//            closes the page.
+// Each thread steps its own access in mmu_step. The handlers find machines
+// through mmu_entries without locking: entries are only ever added, under
+// mmu_lock, and an entry whose machine is gone is reused for the next one.
+// Faults and traps that are not ours go to the handlers installed before.
+//
+// Host code that reads or writes guest memory in bulk (string output,
+// images, checkpoints, clones, --aot) must not fault into a device: it opens
+// the device pages around the copy, or stops short of them (see
+// mmu_reach()). Single-stepping needs the trap flag, so this mode does not
+// run under a debugger or anything else that ptrace()s the process.
+#ifdef LC3_HOST_MMU
+struct mmu_entry
+{
+    _Atomic(struct vm*) vm;         // NULL when free
+    struct mmu_entry* next;
+};
+
+_Atomic(struct mmu_entry*) mmu_entries = NULL;
+pthread_mutex_t mmu_lock = PTHREAD_MUTEX_INITIALIZER;   // for adding and freeing entries
+size_t mmu_words = 0;               // words per host page, set before any fault
+struct sigaction mmu_old_segv;      // the handlers from before mmu_register()
+struct sigaction mmu_old_trap;
+
+enum { MMU_IDLE, MMU_STEP, MMU_SERVICE };
+
+// The one access a thread is stepping through. The context is the one the
+// access faulted (or, for a store, single-stepped) in, and goes back in
+// once mmu_service() is done. The floating-point save area is copied whole,
+// extended state included, since the device may use any register.
+struct mmu_step
+{
+    volatile int stage;
+    struct vm* vm;
+    uint16_t address;
+    int write;
+    gregset_t gregs;
+    size_t fp_size;
+    uint8_t fp[8192] __attribute__((aligned(64)));
+};
+
+__thread struct mmu_step mmu_step;
+
+// Whether the host page from word base holds a device register.
+int mmu_device(struct vm* vm, size_t base)
+{
+    int device = 0;
+    for (size_t a = base; a < base + mmu_words; a += 1 << PAGE_BITS)
+    {
+        device |= vm->device_page[a >> PAGE_BITS];
+    }
+    return device;
+}
+
+void mmu_protect(struct vm* vm, int protect)
+{
+    for (size_t base = 0; base < MEMORY_MAX; base += mmu_words)
+    {
+        if (mmu_device(vm, base))
+        {
+            mprotect(vm->memory + base, mmu_words * sizeof(uint16_t),
+                protect ? PROT_NONE : PROT_READ | PROT_WRITE);
+        }
+    }
+}
+
+// Words from address up to the first protected host page, 0 if address is
+// on one.
+size_t mmu_reach(struct vm* vm, size_t address)
+{
+    size_t base = address - address % mmu_words;
+    while (base < MEMORY_MAX && !mmu_device(vm, base)) base += mmu_words;
+    return base > address ? base - address : 0;
+}
+
+// Only compares addresses: memory[] is at the start of the machine.
+struct vm* mmu_find(const void* p)
+{
+    for (struct mmu_entry* e = atomic_load(&mmu_entries); e; e = e->next)
+    {
+        struct vm* vm = atomic_load(&e->vm);
+        if (vm && (const uint16_t*)p >= (const uint16_t*)vm && (const uint16_t*)p < (const uint16_t*)vm + MEMORY_MAX)
+        {
+            return vm;
+        }
+    }
+    return NULL;
+}
+
+void mmu_save(ucontext_t* uc)
+{
+    memcpy(mmu_step.gregs, uc->uc_mcontext.gregs, sizeof(gregset_t));
+    // An XSAVE area says how big it is after the legacy 512 bytes.
+    const uint32_t* sw = (const uint32_t*)((const uint8_t*)uc->uc_mcontext.fpregs + 464);
+    mmu_step.fp_size = sw[0] == 0x46505853 ? sw[1] : 512;     // FP_XSTATE_MAGIC1
+    if (mmu_step.fp_size > sizeof(mmu_step.fp)) abort();
+    memcpy(mmu_step.fp, uc->uc_mcontext.fpregs, mmu_step.fp_size);
+}
+
+void mmu_restore(ucontext_t* uc)
+{
+    memcpy(uc->uc_mcontext.gregs, mmu_step.gregs, sizeof(gregset_t));
+    memcpy(uc->uc_mcontext.fpregs, mmu_step.fp, mmu_step.fp_size);
+}
+
+void mmu_service();
+
+// Return from the handler into mmu_service(), below the red zone of the
+// interrupted code, as if it had been called there.
+void mmu_enter_service(ucontext_t* uc)
+{
+    mmu_save(uc);
+    greg_t* g = uc->uc_mcontext.gregs;
+    g[REG_RSP] = ((g[REG_RSP] - 128) & ~(greg_t)15) - 8;
+    g[REG_RIP] = (greg_t)mmu_service;
+    g[REG_EFL] &= ~(greg_t)0x500;   // TF and DF
+    mmu_step.stage = MMU_SERVICE;
+}
+
+void mmu_service()
+{
+    int saved_errno = errno;    // the interrupted code may be about to read it
+    struct vm* vm = mmu_step.vm;
+    uint16_t address = mmu_step.address;
+    if (mmu_step.write) device_write(vm, address, vm->memory[address]);
+    else vm->memory[address] = device_read(vm, address);
+    errno = saved_errno;
+    __asm__ volatile ("int3");
+    abort();    // the handler never comes back here
+}
+
+// Hand a signal that is not ours to the handler installed before. The
+// default action is taken by raising the signal again with it restored; it
+// arrives once this handler returns.
+void mmu_chain(int signal, siginfo_t* info, void* context)
+{
+    const struct sigaction* old = signal == SIGSEGV ? &mmu_old_segv : &mmu_old_trap;
+    if (old->sa_flags & SA_SIGINFO)
+    {
+        old->sa_sigaction(signal, info, context);
+    }
+    else if (old->sa_handler != SIG_DFL && old->sa_handler != SIG_IGN)
+    {
+        old->sa_handler(signal);
+    }
+    else if (old->sa_handler == SIG_DFL || signal == SIGSEGV)    // a fault can't be ignored
+    {
+        sigaction(signal, &(struct sigaction){ .sa_handler = SIG_DFL }, NULL);
+        raise(signal);
+    }
+}
+
+void mmu_fault(int signal, siginfo_t* info, void* context)
+{
+    ucontext_t* uc = context;
+    struct vm* vm = mmu_step.stage == MMU_IDLE ? mmu_find(info->si_addr) : NULL;
+    if (!vm)
+    {
+        mmu_chain(signal, info, context);
+        return;
+    }
+
+    mmu_protect(vm, 0);
+    mmu_step.vm = vm;
+    mmu_step.address = (const uint16_t*)info->si_addr - vm->memory;
+    mmu_step.write = (uc->uc_mcontext.gregs[REG_ERR] & 2) != 0;
+    if (mmu_step.write)
+    {
+        uc->uc_mcontext.gregs[REG_EFL] |= 0x100;    // TF
+        mmu_step.stage = MMU_STEP;
+    }
+    else
+    {
+        mmu_enter_service(uc);
+    }
+}
+
+void mmu_trap(int signal, siginfo_t* info, void* context)
+{
+    ucontext_t* uc = context;
+    switch (mmu_step.stage)
+    {
+        case MMU_STEP:
+            // The access has run.
+            if (mmu_step.write)
+            {
+                mmu_enter_service(uc);
+                return;
+            }
+            uc->uc_mcontext.gregs[REG_EFL] &= ~(greg_t)0x100;
+            break;
+
+        case MMU_SERVICE:
+            // The int3 at the end of mmu_service().
+            mmu_restore(uc);
+            if (!mmu_step.write)
+            {
+                uc->uc_mcontext.gregs[REG_EFL] |= 0x100;
+                mmu_step.stage = MMU_STEP;
+                return;
+            }
+            // The store's context was saved at its single-step trap.
+            uc->uc_mcontext.gregs[REG_EFL] &= ~(greg_t)0x100;
+            break;
+
+        default:
+            mmu_chain(signal, info, context);
+            return;
+    }
+    mmu_protect(mmu_step.vm, 1);
+    mmu_step.stage = MMU_IDLE;
+}
+
+void mmu_register(struct vm* vm)
+{
+    pthread_mutex_lock(&mmu_lock);
+    if (!mmu_words)
+    {
+        mmu_words = (size_t)sysconf(_SC_PAGESIZE) / sizeof(uint16_t);
+        struct sigaction sa = { .sa_sigaction = mmu_fault, .sa_flags = SA_SIGINFO };
+        sigaction(SIGSEGV, &sa, &mmu_old_segv);
+        sa.sa_sigaction = mmu_trap;
+        sigaction(SIGTRAP, &sa, &mmu_old_trap);
+    }
+    struct mmu_entry* e = atomic_load(&mmu_entries);
+    while (e && atomic_load(&e->vm)) e = e->next;
+    if (!e)
+    {
+        e = calloc(1, sizeof(struct mmu_entry));
+        if (!e) abort();
+        e->next = atomic_load(&mmu_entries);
+        atomic_store(&mmu_entries, e);
+    }
+    atomic_store(&e->vm, vm);
+    vm->mmu_entry = e;
+    pthread_mutex_unlock(&mmu_lock);
+}
+
+void mmu_unregister(struct vm* vm)
+{
+    pthread_mutex_lock(&mmu_lock);
+    atomic_store(&vm->mmu_entry->vm, NULL);
+    pthread_mutex_unlock(&mmu_lock);
+}
+#endif
+
+// KEYBOARD
+// Reading KBSR polls the keyboard and latches a waiting key into KBDR.
+// A guest that keeps finding no key within a few instructions of the last
+// poll, with no store, trap or change to its registers or flags in between,
+// is only spinning until one comes, so after IDLE_POLLS such polls the
+// machine sleeps in input_wait() and this poll returns the key that woke it.
+// Spinners and animations print or store on every pass, and a guest timing
+// out counts, so none of them builds up a streak. The one change let through
+// is a seed counter, a single register one higher at every poll (with the
+// flags, if they are its own), which is how 2048 waits for its first key.
+// A timeout can count up the same way, so a streak with a counter has to
+// last IDLE_LAP polls: by then the counter has been through every value,
+// and a loop that branches on it would have left.
+#define IDLE_GAP 16
+#define IDLE_POLLS 1024
+#define IDLE_LAP 65536
+
+// How R0-R7 and the flags differ from the last empty poll: -1 if they do,
+// 1 + r if only register r went up by one, else 0.
+int idle_change(struct vm* vm, uint16_t flags)
+{
+    int counter = 0;
+    for (int r = R_R0; r <= R_R7; ++r)
+    {
+        if (vm->reg[r] == vm->idle_reg[r]) continue;
+        if (vm->reg[r] != (uint16_t)(vm->idle_reg[r] + 1) || counter) return -1;
+        counter = 1 + r;
+    }
+    if (flags == vm->idle_flags) return counter;
+    return counter && flags == result_flags(vm->reg[counter - 1]) ? counter : -1;
+}
+
+// Called on a poll that found no key; returns whether it waited for one.
+int keyboard_idle(struct vm* vm)
+{
+    output_tick(vm);
+    if (vm->script) return 0;   // spinning is how scripted time passes
+    uint16_t flags = cond_flags(vm);
+    int counter = idle_change(vm, flags);
+    if (vm->instr_count - vm->idle_last > IDLE_GAP || vm->stores != vm->idle_stores || counter < 0
+        || (counter && vm->idle_counter && counter != vm->idle_counter))
+    {
+        vm->idle_polls = 0;
+        vm->idle_counter = 0;
+    }
+    else if (counter && !vm->idle_counter)
+    {
+        vm->idle_polls = 0;     // the lap starts here
+        vm->idle_counter = counter;
+    }
+    vm->idle_last = vm->instr_count;
+    vm->idle_stores = vm->stores;
+    memcpy(vm->idle_reg, vm->reg, sizeof(vm->idle_reg));
+    vm->idle_flags = flags;
+    if (vm->idle_counter && !counter) return 0;     // only the counter's steps make the lap
+    if (++vm->idle_polls < (vm->idle_counter ? IDLE_LAP : IDLE_POLLS)) return 0;
+    vm->idle_polls = 0;
+    vm->idle_counter = 0;
+    ++vm->idle_waits;
+    output_flush(vm);       // everything up to here is on screen while it waits
+    input_wait(vm);
+    return 1;
+}
+
+uint16_t keyboard_read(struct vm* vm, void* context, uint16_t address)
+{
+    (void)context;
+    if (address == MR_KBSR)
+    {
+        if (input_ready(vm) || keyboard_idle(vm))
+        {
+            vm->memory[MR_KBSR] = (1 << 15);
+            vm->memory[MR_KBDR] = input_getc(vm);
+        }
+        else
+        {
+            vm->memory[MR_KBSR] = 0;
+        }
+        vm->page_stamp[MR_KBSR >> PAGE_BITS] = vm->clock;
+    }
+    return vm->memory[address];
+}
+
+void decode_word(struct vm* vm, uint16_t address)
+{
+    uint16_t instr = vm->memory[address];
+    struct decoded* d = &vm->decoded[address];
+    d->r0 = (instr >> 9) & 0x7;
+    d->r1 = (instr >> 6) & 0x7;
+    d->r2 = instr & 0x7;
+    d->imm = 0;
+
+    switch (instr >> 12)
+    {
+        case OP_BR:  d->handler = H_BR;  d->imm = sign_extend(instr & 0x1FF, 9); break;
+        case OP_NOT: d->handler = H_NOT; break;
+        case OP_LD:  d->handler = H_LD;  d->imm = sign_extend(instr & 0x1FF, 9); break;
+        case OP_LDI: d->handler = H_LDI; d->imm = sign_extend(instr & 0x1FF, 9); break;
+        case OP_LDR: d->handler = H_LDR; d->imm = sign_extend(instr & 0x3F, 6);  break;
+        case OP_LEA: d->handler = H_LEA; d->imm = sign_extend(instr & 0x1FF, 9); break;
+        case OP_ST:  d->handler = H_ST;  d->imm = sign_extend(instr & 0x1FF, 9); break;
+        case OP_STI: d->handler = H_STI; d->imm = sign_extend(instr & 0x1FF, 9); break;
+        case OP_STR: d->handler = H_STR; d->imm = sign_extend(instr & 0x3F, 6);  break;
+        case OP_JMP: d->handler = H_JMP; break;
+        case OP_TRAP: d->handler = H_TRAP; d->imm = instr & 0xFF; break;
+
+        case OP_ADD:
+        case OP_AND:
+            if ((instr >> 5) & 0x1)
+            {
+                d->handler = (instr >> 12) == OP_ADD ? H_ADD_IMM : H_AND_IMM;
+                d->imm = sign_extend(instr & 0x1F, 5);
+            }
+            else
+            {
+                d->handler = (instr >> 12) == OP_ADD ? H_ADD_REG : H_AND_REG;
+            }
+            break;
+
+        case OP_JSR:
+            if ((instr >> 11) & 1)
+            {
+                d->handler = H_JSR;
+                d->imm = sign_extend(instr & 0x7FF, 11);
+            }
+            else
+            {
+                d->handler = H_JSRR;
+            }
+            break;
+
+        default:
+            d->handler = H_BAD;
+            break;
+    }
+    d->base = d->handler;
+    vm->code_map[address >> 3] |= 1 << (address & 7);
+}
+
+// Decode a word and, when it forms a pair listed in FUSED_PAIRS with the word
+// after it, turn it into the superinstruction for both.
+void decode(struct vm* vm, uint16_t address)
+{
+    decode_word(vm, address);
+    if (address == MEMORY_MAX - 1) return;
+
+    struct decoded* next = &vm->decoded[address + 1];
+    if (next->base == H_DECODE) decode_word(vm, address + 1);
+
+    uint8_t fused = fusion_table[vm->decoded[address].base][next->base];
+    if (fused) vm->decoded[address].handler = fused;
+}
+
+// Translate the instruction at pc into one micro-op.
+void translate_uop(struct uop* u, uint16_t pc, uint16_t instr)
+{
+    ++pc;   // PC-relative operands count from the next instruction
+    u->r0 = (instr >> 9) & 0x7;
+    u->r1 = (instr >> 6) & 0x7;
+    u->r2 = instr & 0x7;
+    u->imm = 0;
+
+    switch (instr >> 12)
+    {
+        case OP_ADD:
+        case OP_AND:
+            if ((instr >> 5) & 0x1)
+            {
+                u->kind = (instr >> 12) == OP_ADD ? U_ADD_IMM : U_AND_IMM;
+                u->imm = sign_extend(instr & 0x1F, 5);
+            }
+            else
+            {
+                u->kind = (instr >> 12) == OP_ADD ? U_ADD_REG : U_AND_REG;
+            }
+            break;
+
+        case OP_NOT: u->kind = U_NOT; break;
+        case OP_LD:  u->kind = U_LD;  u->imm = pc + sign_extend(instr & 0x1FF, 9); break;
+        case OP_LDI: u->kind = U_LDI; u->imm = pc + sign_extend(instr & 0x1FF, 9); break;
+        case OP_LDR: u->kind = U_LDR; u->imm = sign_extend(instr & 0x3F, 6);       break;
+        case OP_LEA: u->kind = U_LEA; u->imm = pc + sign_extend(instr & 0x1FF, 9); break;
+        case OP_ST:  u->kind = U_ST;  u->imm = pc + sign_extend(instr & 0x1FF, 9); break;
+        case OP_STI: u->kind = U_STI; u->imm = pc + sign_extend(instr & 0x1FF, 9); break;
+        case OP_STR: u->kind = U_STR; u->imm = sign_extend(instr & 0x3F, 6);       break;
+        case OP_BR:  u->kind = U_BR;  u->imm = pc + sign_extend(instr & 0x1FF, 9); break;
+        case OP_JMP: u->kind = U_JMP; break;
+        case OP_TRAP: u->kind = U_TRAP; u->imm = instr & 0xFF; break;
+
+        case OP_JSR:
+            if ((instr >> 11) & 1)
+            {
+                u->kind = U_JSR;
+                u->imm = pc + sign_extend(instr & 0x7FF, 11);
+            }
+            else
+            {
+                u->kind = U_JSRR;
+            }
+            break;
+
+        default:
+            u->kind = U_BAD;
+            break;
+    }
+}
+
+struct block* translate_block(struct vm* vm, uint16_t start)
+{
+    struct uop ops[BLOCK_MAX + 1];
+    uint16_t pc = start;
+    int n = 0;
+
+    while (n < BLOCK_MAX)
+    {
+        struct uop* u = &ops[n++];
+        translate_uop(u, pc, vm->memory[pc]);
+        vm->code_map[pc >> 3] |= 1 << (pc & 7);
+        ++pc;
+        if (u->kind >= U_BR) break;
+    }
+
+    int length = n;
+    if (ops[n - 1].kind < U_BR)
+    {
+        ops[n++].kind = U_END;
+    }
+
+    struct block* b = malloc(sizeof(struct block) + n * sizeof(struct uop));
+    if (!b) abort();
+    b->start = start;
+    b->length = length;
+    b->epoch = vm->block_epoch;
+    b->taken = NULL;
+    b->fallthrough = NULL;
+    b->retired = NULL;
+    memcpy(b->ops, ops, n * sizeof(struct uop));
+    vm->block_at[start] = b;
+    return b;
+}
+
+struct block* find_block(struct vm* vm, uint16_t start)
+{
+    while (vm->retired_blocks)
+    {
+        struct block* b = vm->retired_blocks;
+        vm->retired_blocks = b->retired;
+        free(b);
+    }
+    if (!vm->block_at)
+    {
+        vm->block_at = calloc(MEMORY_MAX, sizeof(struct block*));
+        if (!vm->block_at) abort();
+    }
+    struct block* b = vm->block_at[start];
+    return b ? b : translate_block(vm, start);
+}
+
+// TRAP ROUTINES
+void execute_trap(struct vm* vm, uint16_t instr)
+{
+    vm->idle_polls = 0;     // a guest that traps between polls is not just waiting
+    vm->idle_counter = 0;
+    vm->reg[R_R7] = vm->reg[R_PC];
+    materialize_flags(vm);
+
+    switch (instr & 0xFF)
+    {
+        case TRAP_GETC:
+            {
+                vm->reg[R_R0] = (uint16_t)input_getc(vm);
+                update_flags(vm, R_R0);
+            }
+            break;
+
+        case TRAP_OUT:
+            {
+                char c = (char)vm->reg[R_R0];
+                output_write(vm, &c, 1);
+            }
+            break;
+
+        case TRAP_PUTS:
+            {
+                output_string(vm, vm->reg[R_R0], 0);
+            }
+            break;
+
+        case TRAP_IN:
+            {
+                output_write(vm, "Enter a character: ", 19);
+                char c = input_getc(vm);
+                output_write(vm, &c, 1);
+                vm->reg[R_R0] = (uint16_t)c;
+                update_flags(vm, R_R0);
+            }
+            break;
+
+        case TRAP_PUTSP:
+            {
+                output_string(vm, vm->reg[R_R0], 1);
+            }
+            break;
+
+        case TRAP_HALT:
+            {
+                output_write(vm, "Shutdown\n", 9);
+                output_flush(vm);
+                vm->running = 0;
+            }
+    }
+    output_tick(vm);
+    if (vm->checkpoint) checkpoint_tick(vm);
+}
+
+// SWITCH DISPATCH
+// One shared indirect branch for every opcode; the reference engine. step()
+// is also how other engines run single instructions they can't handle.
+// execute() takes the PC and returns the next one, so run_switch() can keep it
+// in a local instead of in vm->reg.
+ALWAYS_INLINE uint16_t execute(struct vm* vm, uint16_t pc)
+{
+    uint16_t instr = mem_fetch(vm, pc++);
+    uint16_t op = instr >> 12;
+    ++vm->instr_count;
+
+    switch (op)
+    {
+        case OP_ADD:
+            {
+                uint16_t r0 = (instr >> 9) & 0x7;           // destination register
+                uint16_t r1 = (instr >> 6) & 0x7;           // first operand
+                uint16_t imm_flag = (instr >> 5) & 0x1;     // immediate indicator
+
+                if (imm_flag)
+                {
+                    uint16_t imm5 = sign_extend(instr & 0x1F, 5);
+                    vm->reg[r0] = vm->reg[r1] + imm5;
+                }
+                else
+                {
+                    uint16_t r2 = instr & 0x7;
+                    vm->reg[r0] = vm->reg[r1] + vm->reg[r2];
+                }
+                update_flags(vm, r0);
+            }
+            break;
+
+        case OP_AND:
+            {
+                uint16_t r0 = (instr >> 9) & 0x7;
+                uint16_t r1 = (instr >> 6) & 0x7;
+                uint16_t imm_flag = (instr >> 5) & 0x1;
+
+                if (imm_flag)
+                {
+                    uint16_t imm5 = sign_extend(instr & 0x1F, 5);
+                    vm->reg[r0] = vm->reg[r1] & imm5;
+                }
+                else
+                {
+                    uint16_t r2 = instr & 0x7;
+                    vm->reg[r0] = vm->reg[r1] & vm->reg[r2];
+                }
+                update_flags(vm, r0);
+            }
+            break;
+        
+        case OP_NOT:
+            {
+                uint16_t r0 = (instr >> 9) & 0x7;
+                uint16_t r1 = (instr >> 6) & 0x7;
+
+                vm->reg[r0] = ~vm->reg[r1];
+                update_flags(vm, r0);
+            }
+            break;
+
+        case OP_BR:
+            {
+                uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+                uint16_t cond_flag = (instr >> 9) & 0x7;
+
+                if (cond_flag & cond_flags(vm))
+                {
+                    pc += pc_offset;
+                }
+            }
+            break;
+        
+        case OP_JMP:
+            {
+                uint16_t r1 = (instr >> 6) & 0x7;
+                pc = vm->reg[r1];
+            }
+            break;
+
+        case OP_JSR:
+            {
+                uint16_t long_flag = (instr >> 11) & 1;
+                vm->reg[R_R7] = pc;
+
+                if (long_flag)
+                {
+                    uint16_t long_pc_offset = sign_extend(instr & 0x7FF, 11);
+                    pc += long_pc_offset;
+                }
+                else
+                {
+                    uint16_t r1 = (instr >> 6) & 0x7;
+                    pc = vm->reg[r1];
+                }
+            }
+            break;
+        
+        case OP_LD:
+            {
+                uint16_t r0 = (instr >> 9) & 0x7;
+                uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+                vm->reg[r0] = mem_read(vm, pc + pc_offset);
+                update_flags(vm, r0);
+            }
+            break;
+
+        case OP_LDI:
+            {
+                uint16_t r0 = (instr >> 9) & 0x7;                       // destination register
+                uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);     // PC offset = 9
+                vm->reg[r0] = mem_read(vm, mem_read(vm, pc + pc_offset));    // Apply offset to PC and return new address
+                update_flags(vm, r0);
+            }
+            break;
+        
+        case OP_LDR:
+            {
+                uint16_t r0 = (instr >> 9) & 0x7;
+                uint16_t r1 = (instr >> 6) & 0x7;
+                uint16_t offset = sign_extend(instr & 0x3F, 6);
+
+                vm->reg[r0] = mem_read(vm, vm->reg[r1] + offset);
+                update_flags(vm, r0);
+            }
+            break;
+        
+        case OP_LEA:
+            {
+                uint16_t r0 = (instr >> 9) & 0x7;
+                uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+
+                vm->reg[r0] = pc + pc_offset;
+                update_flags(vm, r0);
+            }
+            break;
+        
+        case OP_ST:
+            {
+                uint16_t r0 = (instr >> 9) & 0x7;
+                uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+                mem_write(vm, pc + pc_offset, vm->reg[r0]);
+            }
+            break;
+
+        case OP_STI:
+            {
+                uint16_t r0 = (instr >> 9) & 0x7;
+                uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+                mem_write(vm, mem_read(vm, pc + pc_offset), vm->reg[r0]);
+            }
+            break;
+        
+        case OP_STR:
+            {
+                uint16_t r0 = (instr >> 9) & 0x7;
+                uint16_t r1 = (instr >> 6) & 0x7;
+                uint16_t offset = sign_extend(instr & 0x3F, 6);
+                mem_write(vm, vm->reg[r1] + offset, vm->reg[r0]);
+            }
+            break;
+
+        case OP_TRAP:
+            vm->reg[R_PC] = pc;
+            execute_trap(vm, instr);
+            break;
+
+        case OP_RES:
+        case OP_RTI:
+        default:        
+            {
+                abort();
+            }
+            break;
+    }
+    return pc;
+}
+
+ALWAYS_INLINE void step(struct vm* vm)
+{
+    vm->reg[R_PC] = execute(vm, vm->reg[R_PC]);
+}
+
+void run_switch(struct vm* vm)
+{
+    uint16_t pc = vm->reg[R_PC];
+    while (vm->running)
+    {
+        pc = execute(vm, pc);
+        output_poll(vm);
+    }
+    vm->reg[R_PC] = pc;
+}
+
+// THREADED DISPATCH
+// Every handler ends in its own indirect jump through the label table, so the
+// host predictor sees one branch site per opcode instead of one for all of
+// them. Needs the GNU "labels as values" extension; other compilers (or
+// -DLC3_NO_COMPUTED_GOTO) get the switch loop.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(LC3_NO_COMPUTED_GOTO)
+#define LC3_COMPUTED_GOTO 1
+#endif
+
+// This and the pre-decoded, word table, block and trace engines keep R0-R7,
+// the last flag-setting result and the instruction count in locals, which
+// stores into memory[] cannot alias, and hand them back to the vm around
+// traps, device accesses and when they return.
+#define REGS_LOAD()     (memcpy(reg, vm->reg, sizeof(reg)), cond = vm->cond_result, count = vm->instr_count)
+#define REGS_SAVE()     regs_save(vm, reg, cond, count)
+#define GUEST_LOAD(a)   regs_load_word(vm, (a), reg, cond, count)
+#define GUEST_STORE(a, v) regs_store_word(vm, (a), (v), reg, cond, count)
+#define OUTPUT_POLL()   do { if (count >= vm->output_check) { REGS_SAVE(); output_tick(vm); } } while (0)
+
+ALWAYS_INLINE void regs_save(struct vm* vm, const uint16_t* reg, uint16_t cond, uint64_t count)
+{
+    memcpy(vm->reg, reg, 8 * sizeof(uint16_t));
+    vm->cond_result = cond;
+    vm->instr_count = count;
+}
+
+// mem_read() and mem_write() for those engines: a device sees the machine as
+// the guest has it at that access. Under LC3_HOST_MMU any access may fault
+// into a device, so the count (which script and idle timing read) goes back
+// at every one; the registers only at a load from KBSR, where the keyboard
+// compares them between polls.
+ALWAYS_INLINE uint16_t regs_load_word(struct vm* vm, uint16_t address,
+    const uint16_t* reg, uint16_t cond, uint64_t count)
+{
+#ifdef LC3_HOST_MMU
+    if (address == MR_KBSR) regs_save(vm, reg, cond, count);
+    else vm->instr_count = count;
+#else
+    if (vm->device_page[address >> PAGE_BITS])
+    {
+        regs_save(vm, reg, cond, count);
+        return device_read(vm, address);
+    }
+#endif
+    return mem_read(vm, address);
+}
+
+ALWAYS_INLINE void regs_store_word(struct vm* vm, uint16_t address, uint16_t val,
+    const uint16_t* reg, uint16_t cond, uint64_t count)
+{
+#ifdef LC3_HOST_MMU
+    (void)reg;
+    (void)cond;
+    vm->instr_count = count;
+#else
+    if (vm->device_page[address >> PAGE_BITS]) regs_save(vm, reg, cond, count);
+#endif
+    mem_write(vm, address, val);
+}
+
+void run_threaded(struct vm* vm)
+{
+#ifdef LC3_COMPUTED_GOTO
+    static void* const dispatch_table[16] =
+    {
+        &&op_br,  &&op_add, &&op_ld,  &&op_st,
+        &&op_jsr, &&op_and, &&op_ldr, &&op_str,
+        &&op_bad, &&op_not, &&op_ldi, &&op_sti,
+        &&op_jmp, &&op_bad, &&op_lea, &&op_trap
+    };
+    uint16_t pc = vm->reg[R_PC];
+    uint16_t instr;
+    uint16_t reg[8];
+    uint16_t cond;
+    uint64_t count;
+    REGS_LOAD();
+
+#define DISPATCH()                                  \
+    do                                              \
+    {                                               \
+        instr = mem_fetch(vm, pc++);                \
+        ++count;                                    \
+        goto *dispatch_table[instr >> 12];          \
+    } while (0)
+
+    DISPATCH();
+
+op_add:
+    {
+        uint16_t r0 = (instr >> 9) & 0x7;
+        uint16_t r1 = (instr >> 6) & 0x7;
+
+        if ((instr >> 5) & 0x1)
+        {
+            reg[r0] = reg[r1] + sign_extend(instr & 0x1F, 5);
+        }
+        else
+        {
+            reg[r0] = reg[r1] + reg[instr & 0x7];
+        }
+        cond = reg[r0];
+    }
+    DISPATCH();
+
+op_and:
+    {
+        uint16_t r0 = (instr >> 9) & 0x7;
+        uint16_t r1 = (instr >> 6) & 0x7;
+
+        if ((instr >> 5) & 0x1)
+        {
+            reg[r0] = reg[r1] & sign_extend(instr & 0x1F, 5);
+        }
+        else
+        {
+            reg[r0] = reg[r1] & reg[instr & 0x7];
+        }
+        cond = reg[r0];
+    }
+    DISPATCH();
+
+op_not:
+    {
+        uint16_t r0 = (instr >> 9) & 0x7;
+        reg[r0] = ~reg[(instr >> 6) & 0x7];
+        cond = reg[r0];
+    }
+    DISPATCH();
+
+op_br:
+    if (((instr >> 9) & 0x7) & result_flags(cond))
+    {
+        pc += sign_extend(instr & 0x1FF, 9);
+        OUTPUT_POLL();
+    }
+    DISPATCH();
+
+op_jmp:
+    pc = reg[(instr >> 6) & 0x7];
+    OUTPUT_POLL();
+    DISPATCH();
+
+op_jsr:
+    {
+        uint16_t target = (instr >> 11) & 1
+            ? pc + sign_extend(instr & 0x7FF, 11)
+            : reg[(instr >> 6) & 0x7];
+        reg[R_R7] = pc;
+        pc = target;
+    }
+    OUTPUT_POLL();
+    DISPATCH();
+
+op_ld:
+    {
+        uint16_t r0 = (instr >> 9) & 0x7;
+        reg[r0] = GUEST_LOAD(pc + sign_extend(instr & 0x1FF, 9));
+        cond = reg[r0];
+    }
+    DISPATCH();
+
+op_ldi:
+    {
+        uint16_t r0 = (instr >> 9) & 0x7;
+        reg[r0] = GUEST_LOAD(GUEST_LOAD(pc + sign_extend(instr & 0x1FF, 9)));
+        cond = reg[r0];
+    }
+    DISPATCH();
+
+op_ldr:
+    {
+        uint16_t r0 = (instr >> 9) & 0x7;
+        reg[r0] = GUEST_LOAD(reg[(instr >> 6) & 0x7] + sign_extend(instr & 0x3F, 6));
+        cond = reg[r0];
+    }
+    DISPATCH();
+
+op_lea:
+    {
+        uint16_t r0 = (instr >> 9) & 0x7;
+        reg[r0] = pc + sign_extend(instr & 0x1FF, 9);
+        cond = reg[r0];
+    }
+    DISPATCH();
+
+op_st:
+    GUEST_STORE(pc + sign_extend(instr & 0x1FF, 9), reg[(instr >> 9) & 0x7]);
+    DISPATCH();
+
+op_sti:
+    GUEST_STORE(GUEST_LOAD(pc + sign_extend(instr & 0x1FF, 9)), reg[(instr >> 9) & 0x7]);
+    DISPATCH();
+
+op_str:
+    GUEST_STORE(reg[(instr >> 6) & 0x7] + sign_extend(instr & 0x3F, 6), reg[(instr >> 9) & 0x7]);
+    DISPATCH();
+
+op_trap:
+    REGS_SAVE();
+    vm->reg[R_PC] = pc;
+    execute_trap(vm, instr);
+    if (!vm->running) return;
+    REGS_LOAD();
+    DISPATCH();
+
+op_bad:
+    abort();
+
+#undef DISPATCH
+#else
+    run_switch(vm);
+#endif
+}
+
+// PRE-DECODED DISPATCH
+// Runs out of decoded[], filling slots the first time they execute, so
+// steady-state loops do no field extraction or sign extension at all.
+
+// Handler bodies, shared by the plain and the fused handlers. pc, reg and
+// cond are the engine's locals, written back around traps.
+#define DO_BR(d)        if ((d)->r0 & result_flags(cond)) { pc += (d)->imm; OUTPUT_POLL(); }
+#define DO_ADD_REG(d)   reg[(d)->r0] = reg[(d)->r1] + reg[(d)->r2]; cond = reg[(d)->r0]
+#define DO_ADD_IMM(d)   reg[(d)->r0] = reg[(d)->r1] + (d)->imm; cond = reg[(d)->r0]
+#define DO_AND_REG(d)   reg[(d)->r0] = reg[(d)->r1] & reg[(d)->r2]; cond = reg[(d)->r0]
+#define DO_AND_IMM(d)   reg[(d)->r0] = reg[(d)->r1] & (d)->imm; cond = reg[(d)->r0]
+#define DO_NOT(d)       reg[(d)->r0] = ~reg[(d)->r1]; cond = reg[(d)->r0]
+#define DO_LD(d)        reg[(d)->r0] = GUEST_LOAD(pc + (d)->imm); cond = reg[(d)->r0]
+#define DO_LDI(d)       reg[(d)->r0] = GUEST_LOAD(GUEST_LOAD(pc + (d)->imm)); cond = reg[(d)->r0]
+#define DO_LDR(d)       reg[(d)->r0] = GUEST_LOAD(reg[(d)->r1] + (d)->imm); cond = reg[(d)->r0]
+#define DO_LEA(d)       reg[(d)->r0] = pc + (d)->imm; cond = reg[(d)->r0]
+#define DO_ST(d)        GUEST_STORE(pc + (d)->imm, reg[(d)->r0])
+#define DO_STI(d)       GUEST_STORE(GUEST_LOAD(pc + (d)->imm), reg[(d)->r0])
+#define DO_STR(d)       GUEST_STORE(reg[(d)->r1] + (d)->imm, reg[(d)->r0])
+#define DO_JMP(d)       pc = reg[(d)->r1]; OUTPUT_POLL()
+#define DO_JSR(d)       reg[R_R7] = pc; pc += (d)->imm; OUTPUT_POLL()
+#define DO_JSRR(d)      { uint16_t target = reg[(d)->r1]; reg[R_R7] = pc; pc = target; OUTPUT_POLL(); }
+#define DO_TRAP(d)      REGS_SAVE(); vm->reg[R_PC] = pc; execute_trap(vm, (d)->imm); if (!vm->running) return; REGS_LOAD()
+
+void run_decoded(struct vm* vm)
+{
+    uint16_t pc = vm->reg[R_PC];
+    struct decoded* d;
+    uint16_t reg[8];
+    uint16_t cond;
+    uint64_t count;
+    REGS_LOAD();
+
+    if (!vm->decoded) vm->decoded = calloc(MEMORY_MAX, sizeof(struct decoded));
+    if (!vm->decoded) abort();
+
+#ifdef LC3_COMPUTED_GOTO
+    static void* const handler_table[F_END] =
+    {
+        &&L_H_DECODE,  &&L_H_BR,      &&L_H_ADD_REG, &&L_H_ADD_IMM,
+        &&L_H_AND_REG, &&L_H_AND_IMM, &&L_H_NOT,     &&L_H_LD,
+        &&L_H_LDI,     &&L_H_LDR,     &&L_H_LEA,     &&L_H_ST,
+        &&L_H_STI,     &&L_H_STR,     &&L_H_JMP,     &&L_H_JSR,
+        &&L_H_JSRR,    &&L_H_TRAP,    &&L_H_BAD,
+#define FUSED_LABEL(a, b) &&L_F_##a##_##b,
+        FUSED_PAIRS(FUSED_LABEL)
+#undef FUSED_LABEL
+    };
+#define CASE(h)     L_##h
+#define DISPATCH()  goto *handler_table[d->handler]
+#define NEXT()                                      \
+    do                                              \
+    {                                               \
+        d = &vm->decoded[pc++];                     \
+        ++count;                                    \
+        DISPATCH();                                 \
+    } while (0)
+
+    NEXT();
+#else
+#define CASE(h)     case h
+#define DISPATCH()  goto dispatch
+#define NEXT()      continue
+
+    for (;;)
+    {
+        d = &vm->decoded[pc++];
+        ++count;
+dispatch:
+        switch (d->handler)
+        {
+#endif
+    CASE(H_DECODE):
+        decode(vm, pc - 1);
+        DISPATCH();
+
+    CASE(H_BR):      DO_BR(d);      NEXT();
+    CASE(H_ADD_REG): DO_ADD_REG(d); NEXT();
+    CASE(H_ADD_IMM): DO_ADD_IMM(d); NEXT();
+    CASE(H_AND_REG): DO_AND_REG(d); NEXT();
+    CASE(H_AND_IMM): DO_AND_IMM(d); NEXT();
+    CASE(H_NOT):     DO_NOT(d);     NEXT();
+    CASE(H_LD):      DO_LD(d);      NEXT();
+    CASE(H_LDI):     DO_LDI(d);     NEXT();
+    CASE(H_LDR):     DO_LDR(d);     NEXT();
+    CASE(H_LEA):     DO_LEA(d);     NEXT();
+    CASE(H_ST):      DO_ST(d);      NEXT();
+    CASE(H_STI):     DO_STI(d);     NEXT();
+    CASE(H_STR):     DO_STR(d);     NEXT();
+    CASE(H_JMP):     DO_JMP(d);     NEXT();
+    CASE(H_JSR):     DO_JSR(d);     NEXT();
+    CASE(H_JSRR):    DO_JSRR(d);    NEXT();
+    CASE(H_TRAP):    DO_TRAP(d);    NEXT();
+
+    CASE(H_BAD):
+        abort();
+
+    // First half, then the second from the next slot. If the first half
+    // stored over the second word its slot is back to H_DECODE, and the
+    // normal fetch picks it up instead.
+#define FUSED_HANDLER(a, b)                         \
+    CASE(F_##a##_##b):                              \
+        DO_##a(d);                                  \
+        if (d[1].handler == H_DECODE) NEXT();       \
+        ++d;                                        \
+        ++pc;                                       \
+        ++count;                                    \
+        DO_##b(d);                                  \
+        NEXT();
+    FUSED_PAIRS(FUSED_HANDLER)
+#undef FUSED_HANDLER
+
+#ifndef LC3_COMPUTED_GOTO
+        }
+    }
+#endif
+#undef CASE
+#undef DISPATCH
+#undef NEXT
+}
+
+// WORD TABLE DISPATCH
+// An instruction is only 16 bits, so every possible word can be decoded ahead
+// of time: WORD_ENTRY(w) is a constant expression for the handler and the
+// operands of word w. With -DLC3_FULL_WORD_TABLE the preprocessor expands it
+// into word_table[], all 65536 words (512 KB of read-only data), and each
+// fetch costs one extra load. Otherwise only the parts that depend on the
+// opcode and flag bits are tabled (word_handler[], word_imm[], under 200
+// bytes) and the register fields are shifted out at run time, which leaves
+// the data cache alone. Nothing is kept per address either way, so stores
+// into code need no invalidation.
+#define WORD_OP(w)      ((w) >> 12)
+
+// Handler for each opcode, a byte each: BR ADD LD ST JSRR AND LDR STR, then
+// BAD NOT LDI STI JMP BAD LEA TRAP. ADD/AND move to their imm5 handler and
+// JSRR to JSR when the flag bit says so.
+#define WORD_HANDLER(w)                                                         \
+    (int)((((WORD_OP(w) < 8 ? 0x0D0904100B070201ULL : 0x110A120E0C080612ULL)    \
+            >> ((WORD_OP(w) & 7) * 8)) & 0xFF)                                  \
+          + ((0x0022 >> WORD_OP(w)) & ((w) >> 5) & 1)                           \
+          - ((0x0010 >> WORD_OP(w)) & ((w) >> 11) & 1))
+
+// Immediate width for each opcode, a nibble each; TRAP's is not sign-extended.
+#define WORD_BITS(w)    (int)((0x89009900665B9959ULL >> (WORD_OP(w) * 4)) & 0xF)
+#define WORD_SIGN(w)    (WORD_OP(w) == OP_TRAP ? 0 : 1 << WORD_BITS(w) >> 1)
+#define WORD_IMM(w)     (uint16_t)((((w) & ((1 << WORD_BITS(w)) - 1)) ^ WORD_SIGN(w)) - WORD_SIGN(w))
+
+#define WORD_ENTRY(w) \
+    { WORD_HANDLER(w), WORD_HANDLER(w), ((w) >> 9) & 0x7, ((w) >> 6) & 0x7, (w) & 0x7, WORD_IMM(w) }
+
+#ifdef LC3_FULL_WORD_TABLE
+#define WORDS_16(h) \
+    WORD_ENTRY(h##0), WORD_ENTRY(h##1), WORD_ENTRY(h##2), WORD_ENTRY(h##3), \
+    WORD_ENTRY(h##4), WORD_ENTRY(h##5), WORD_ENTRY(h##6), WORD_ENTRY(h##7), \
+    WORD_ENTRY(h##8), WORD_ENTRY(h##9), WORD_ENTRY(h##A), WORD_ENTRY(h##B), \
+    WORD_ENTRY(h##C), WORD_ENTRY(h##D), WORD_ENTRY(h##E), WORD_ENTRY(h##F),
+#define WORDS_256(h) \
+    WORDS_16(h##0) WORDS_16(h##1) WORDS_16(h##2) WORDS_16(h##3) \
+    WORDS_16(h##4) WORDS_16(h##5) WORDS_16(h##6) WORDS_16(h##7) \
+    WORDS_16(h##8) WORDS_16(h##9) WORDS_16(h##A) WORDS_16(h##B) \
+    WORDS_16(h##C) WORDS_16(h##D) WORDS_16(h##E) WORDS_16(h##F)
+#define WORDS_4096(h) \
+    WORDS_256(h##0) WORDS_256(h##1) WORDS_256(h##2) WORDS_256(h##3) \
+    WORDS_256(h##4) WORDS_256(h##5) WORDS_256(h##6) WORDS_256(h##7) \
+    WORDS_256(h##8) WORDS_256(h##9) WORDS_256(h##A) WORDS_256(h##B) \
+    WORDS_256(h##C) WORDS_256(h##D) WORDS_256(h##E) WORDS_256(h##F)
+
+const struct decoded word_table[MEMORY_MAX] =
+{
+    WORDS_4096(0x0) WORDS_4096(0x1) WORDS_4096(0x2) WORDS_4096(0x3)
+    WORDS_4096(0x4) WORDS_4096(0x5) WORDS_4096(0x6) WORDS_4096(0x7)
+    WORDS_4096(0x8) WORDS_4096(0x9) WORDS_4096(0xA) WORDS_4096(0xB)
+    WORDS_4096(0xC) WORDS_4096(0xD) WORDS_4096(0xE) WORDS_4096(0xF)
+};
+
+#undef WORDS_16
+#undef WORDS_256
+#undef WORDS_4096
+#else
+// Indexed by opcode, bit 11 and bit 5, the only bits that pick a handler.
+#define WORD_KEY(w)     (WORD_OP(w) << 2 | ((w) >> 10 & 2) | ((w) >> 5 & 1))
+#define WORD_KEYS(op) \
+    WORD_HANDLER(op << 12), WORD_HANDLER(op << 12 | 0x0020), \
+    WORD_HANDLER(op << 12 | 0x0800), WORD_HANDLER(op << 12 | 0x0820)
+
+const uint8_t word_handler[64] =
+{
+    WORD_KEYS(0x0), WORD_KEYS(0x1), WORD_KEYS(0x2), WORD_KEYS(0x3),
+    WORD_KEYS(0x4), WORD_KEYS(0x5), WORD_KEYS(0x6), WORD_KEYS(0x7),
+    WORD_KEYS(0x8), WORD_KEYS(0x9), WORD_KEYS(0xA), WORD_KEYS(0xB),
+    WORD_KEYS(0xC), WORD_KEYS(0xD), WORD_KEYS(0xE), WORD_KEYS(0xF)
+};
+
+#define WORD_MASK(op)   { (1 << WORD_BITS(op << 12)) - 1, WORD_SIGN(op << 12) }
+
+const struct { uint16_t mask, sign; } word_imm[16] =
+{
+    WORD_MASK(0x0), WORD_MASK(0x1), WORD_MASK(0x2), WORD_MASK(0x3),
+    WORD_MASK(0x4), WORD_MASK(0x5), WORD_MASK(0x6), WORD_MASK(0x7),
+    WORD_MASK(0x8), WORD_MASK(0x9), WORD_MASK(0xA), WORD_MASK(0xB),
+    WORD_MASK(0xC), WORD_MASK(0xD), WORD_MASK(0xE), WORD_MASK(0xF)
+};
+
+#undef WORD_KEYS
+#undef WORD_MASK
+#endif
+
+void run_table(struct vm* vm)
+{
+    uint16_t pc = vm->reg[R_PC];
+    uint16_t reg[8];
+    uint16_t cond;
+    uint64_t count;
+    REGS_LOAD();
+#ifdef LC3_FULL_WORD_TABLE
+    const struct decoded* d;
+#define FETCH()     d = &word_table[mem_fetch(vm, pc++)]
+#else
+    struct decoded word;
+    const struct decoded* d = &word;
+#define FETCH()                                             \
+    do                                                      \
+    {                                                       \
+        uint16_t w = mem_fetch(vm, pc++);                   \
+        word.handler = word_handler[WORD_KEY(w)];           \
+        word.r0 = (w >> 9) & 0x7;                           \
+        word.r1 = (w >> 6) & 0x7;                           \
+        word.r2 = w & 0x7;                                  \
+        word.imm = ((w & word_imm[WORD_OP(w)].mask)         \
+                    ^ word_imm[WORD_OP(w)].sign)            \
+                   - word_imm[WORD_OP(w)].sign;             \
+    } while (0)
+#endif
+
+#ifdef LC3_COMPUTED_GOTO
+    static void* const handler_table[H_COUNT] =
+    {
+        &&L_H_DECODE,  &&L_H_BR,      &&L_H_ADD_REG, &&L_H_ADD_IMM,
+        &&L_H_AND_REG, &&L_H_AND_IMM, &&L_H_NOT,     &&L_H_LD,
+        &&L_H_LDI,     &&L_H_LDR,     &&L_H_LEA,     &&L_H_ST,
+        &&L_H_STI,     &&L_H_STR,     &&L_H_JMP,     &&L_H_JSR,
+        &&L_H_JSRR,    &&L_H_TRAP,    &&L_H_BAD
+    };
+#define CASE(h)     L_##h
+#define NEXT()                                      \
+    do                                              \
+    {                                               \
+        FETCH();                                    \
+        ++count;                                    \
+        goto *handler_table[d->handler];            \
+    } while (0)
+
+    NEXT();
+#else
+#define CASE(h)     case h
+#define NEXT()      continue
+
+    for (;;)
+    {
+        FETCH();
+        ++count;
+        switch (d->handler)
+        {
+#endif
+    CASE(H_BR):      DO_BR(d);      NEXT();
+    CASE(H_ADD_REG): DO_ADD_REG(d); NEXT();
+    CASE(H_ADD_IMM): DO_ADD_IMM(d); NEXT();
+    CASE(H_AND_REG): DO_AND_REG(d); NEXT();
+    CASE(H_AND_IMM): DO_AND_IMM(d); NEXT();
+    CASE(H_NOT):     DO_NOT(d);     NEXT();
+    CASE(H_LD):      DO_LD(d);      NEXT();
+    CASE(H_LDI):     DO_LDI(d);     NEXT();
+    CASE(H_LDR):     DO_LDR(d);     NEXT();
+    CASE(H_LEA):     DO_LEA(d);     NEXT();
+    CASE(H_ST):      DO_ST(d);      NEXT();
+    CASE(H_STI):     DO_STI(d);     NEXT();
+    CASE(H_STR):     DO_STR(d);     NEXT();
+    CASE(H_JMP):     DO_JMP(d);     NEXT();
+    CASE(H_JSR):     DO_JSR(d);     NEXT();
+    CASE(H_JSRR):    DO_JSRR(d);    NEXT();
+    CASE(H_TRAP):    DO_TRAP(d);    NEXT();
+
+    CASE(H_DECODE):
+    CASE(H_BAD):
+        abort();
+
+#ifndef LC3_COMPUTED_GOTO
+        }
+    }
+#endif
+#undef CASE
+#undef NEXT
+#undef FETCH
+}
+
+// PAIR PROFILE
+// Runs the switch interpreter and counts which handlers execute back to back
+// from consecutive words. On exit (HALT or Ctrl-C, since games rarely halt)
+// the most frequent pairs whose first half can be fused are printed as a
+// ready-to-paste FUSED_PAIRS list; tools/fused-pairs.sh merges the lists of
+// the committed scripts into the table.
+#define PROFILE_PAIRS 16
+
+uint64_t pair_count[H_COUNT][H_COUNT];
+
+void print_pair_profile()
+{
+    uint64_t total = 0;
+    for (int a = 0; a < H_COUNT; ++a)
+        for (int b = 0; b < H_COUNT; ++b)
+            total += pair_count[a][b];
+
+    fprintf(stderr, "#define FUSED_PAIRS(X) \\\n");
+    for (int i = 0; i < PROFILE_PAIRS; ++i)
+    {
+        int best_a = 0, best_b = 0;
+        for (int a = H_ADD_REG; a <= H_STR; ++a)        // straight-line first halves
+            for (int b = H_BR; b <= H_TRAP; ++b)
+                if (pair_count[a][b] > pair_count[best_a][best_b]) best_a = a, best_b = b;
+        if (!pair_count[best_a][best_b]) break;
+
+        fprintf(stderr, "    X(%s, %s) /* %.1f%% */ \\\n", handler_names[best_a],
+                handler_names[best_b], total ? 100.0 * pair_count[best_a][best_b] / total : 0.0);
+        pair_count[best_a][best_b] = 0;
+    }
+    fprintf(stderr, "\n");
+}
+
+void run_profile(struct vm* vm)
+{
+    uint16_t prev_pc = 0;
+    uint8_t prev = H_DECODE;
+
+    if (!vm->decoded) vm->decoded = calloc(MEMORY_MAX, sizeof(struct decoded));
+    if (!vm->decoded) abort();
+
+    atexit(print_pair_profile);
+    while (vm->running)
+    {
+        uint16_t pc = vm->reg[R_PC];
+        if (vm->decoded[pc].base == H_DECODE) decode_word(vm, pc);
+        uint8_t h = vm->decoded[pc].base;
+        if (prev != H_DECODE && pc == (uint16_t)(prev_pc + 1)) ++pair_count[prev][h];
+        step(vm);
+        output_poll(vm);
+        prev_pc = pc;
+        prev = h;
+    }
+}
+
+// BLOCK DISPATCH
+// Runs whole translated blocks. Block exits remember their successor, so a
+// hot loop goes from block to block without touching block_at[] at all.
+void run_blocks(struct vm* vm)
+{
+    struct block* b = find_block(vm, vm->reg[R_PC]);
+    struct uop* u;
+    uint32_t epoch;
+    uint16_t reg[8];
+    uint16_t cond;
+    uint64_t count;
+    REGS_LOAD();
+
+#ifdef LC3_COMPUTED_GOTO
+    static void* const uop_table[U_COUNT] =
+    {
+        &&L_U_ADD_REG, &&L_U_ADD_IMM, &&L_U_AND_REG, &&L_U_AND_IMM,
+        &&L_U_NOT,     &&L_U_LD,      &&L_U_LDI,     &&L_U_LDR,
+        &&L_U_LEA,     &&L_U_ST,      &&L_U_STI,     &&L_U_STR,
+        &&L_U_BR,      &&L_U_JMP,     &&L_U_JSR,     &&L_U_JSRR,
+        &&L_U_TRAP,    &&L_U_BAD,     &&L_U_END
+    };
+#define CASE(k)     L_##k
+#define ENTER()     goto *uop_table[u->kind]
+#define NEXT()      goto *uop_table[(++u)->kind]
+#else
+#define CASE(k)     case k
+#define ENTER()     goto dispatch
+#define NEXT()      { ++u; goto dispatch; }
+#endif
+
+    // Follow (and if needed make) the link from b to the block at R_PC.
+#define CHAIN(link)                                                     \
+    do                                                                  \
+    {                                                                   \
+        if (b->epoch != vm->block_epoch)                                \
+        {                                                               \
+            b->taken = b->fallthrough = NULL;                           \
+            b->epoch = vm->block_epoch;                                 \
+        }                                                               \
+        if (!b->link || b->link->start != vm->reg[R_PC])                \
+        {                                                               \
+            b->link = find_block(vm, vm->reg[R_PC]);                    \
+        }                                                               \
+        b = b->link;                                                    \
+        OUTPUT_POLL();                                                  \
+        goto enter;                                                     \
+    } while (0)
+
+enter:
+    epoch = vm->block_epoch;
+    u = b->ops;
+    ENTER();
+#ifndef LC3_COMPUTED_GOTO
+dispatch:
+    switch (u->kind)
+    {
+#endif
+
+    CASE(U_ADD_REG):
+        reg[u->r0] = reg[u->r1] + reg[u->r2];
+        cond = reg[u->r0];
+        NEXT();
+
+    CASE(U_ADD_IMM):
+        reg[u->r0] = reg[u->r1] + u->imm;
+        cond = reg[u->r0];
+        NEXT();
+
+    CASE(U_AND_REG):
+        reg[u->r0] = reg[u->r1] & reg[u->r2];
+        cond = reg[u->r0];
+        NEXT();
+
+    CASE(U_AND_IMM):
+        reg[u->r0] = reg[u->r1] & u->imm;
+        cond = reg[u->r0];
+        NEXT();
+
+    CASE(U_NOT):
+        reg[u->r0] = ~reg[u->r1];
+        cond = reg[u->r0];
+        NEXT();
+
+    CASE(U_LD):
+        reg[u->r0] = GUEST_LOAD(u->imm);
+        cond = reg[u->r0];
+        NEXT();
+
+    CASE(U_LDI):
+        reg[u->r0] = GUEST_LOAD(GUEST_LOAD(u->imm));
+        cond = reg[u->r0];
+        NEXT();
+
+    CASE(U_LDR):
+        reg[u->r0] = GUEST_LOAD(reg[u->r1] + u->imm);
+        cond = reg[u->r0];
+        NEXT();
+
+    CASE(U_LEA):
+        reg[u->r0] = u->imm;
+        cond = reg[u->r0];
+        NEXT();
+
+    // A store that invalidated any block leaves through store_exit, since
+    // the rest of this block (or its links) may now be stale.
+    CASE(U_ST):
+        GUEST_STORE(u->imm, reg[u->r0]);
+        if (vm->block_epoch != epoch) goto store_exit;
+        NEXT();
+
+    CASE(U_STI):
+        GUEST_STORE(GUEST_LOAD(u->imm), reg[u->r0]);
+        if (vm->block_epoch != epoch) goto store_exit;
+        NEXT();
+
+    CASE(U_STR):
+        GUEST_STORE(reg[u->r1] + u->imm, reg[u->r0]);
+        if (vm->block_epoch != epoch) goto store_exit;
+        NEXT();
+
+    CASE(U_BR):
+        count += b->length;
+        if (u->r0 & result_flags(cond))
+        {
+            vm->reg[R_PC] = u->imm;
+            CHAIN(taken);
+        }
+        vm->reg[R_PC] = b->start + b->length;
+        CHAIN(fallthrough);
+
+    CASE(U_JMP):
+        count += b->length;
+        vm->reg[R_PC] = reg[u->r1];
+        CHAIN(taken);
+
+    CASE(U_JSR):
+        count += b->length;
+        reg[R_R7] = b->start + b->length;
+        vm->reg[R_PC] = u->imm;
+        CHAIN(taken);
+
+    CASE(U_JSRR):
+        count += b->length;
+        vm->reg[R_PC] = reg[u->r1];
+        reg[R_R7] = b->start + b->length;
+        CHAIN(taken);
+
+    CASE(U_TRAP):
+        count += b->length;
+        vm->reg[R_PC] = b->start + b->length;
+        REGS_SAVE();
+        execute_trap(vm, u->imm);
+        if (!vm->running) return;
+        REGS_LOAD();
+        CHAIN(fallthrough);
+
+    CASE(U_BAD):
+        abort();
+
+    CASE(U_END):
+        count += b->length;
+        vm->reg[R_PC] = b->start + b->length;
+        CHAIN(fallthrough);
+
+#ifndef LC3_COMPUTED_GOTO
+    }
+#endif
+
+store_exit:
+    count += u - b->ops + 1;
+    vm->reg[R_PC] = b->start + (u - b->ops) + 1;
+    b = find_block(vm, vm->reg[R_PC]);
+    goto enter;
+
+#undef CASE
+#undef ENTER
+#undef NEXT
+#undef CHAIN
+}
+
+// TRACE DISPATCH
+// Interprets with step() and counts taken backward branches per target. Once
+// a loop header is hot, the path from it is recorded as a linear trace and
+// replayed as a micro-op loop. Branches along the path become guards that
+// side-exit back to step(); the loop hands its locals back on the way out.
+#define TRACE_HOT 64
+#define TRACE_MAX 256
+
+enum
+{
+    T_GUARD_TAKEN = U_COUNT,    // recorded BR was taken; exit to pc + 1 if not
+    T_GUARD_NOT_TAKEN,          // recorded BR fell through; exit to imm if taken
+    T_LINK,                     // JSR: R7 = pc + 1, the target is the next op
+    T_GUARD_JMP,                // JMP/RET: exit unless the register holds imm
+    T_GUARD_JSRR                // JSRR: link R7, then as T_GUARD_JMP
+};
+
+struct trace_op
+{
+    struct uop u;
+    uint16_t pc;        // guest address of the instruction
+};
+
+struct trace
+{
+    uint16_t header;
+    uint16_t length;
+    struct trace* next;
+    struct trace_op ops[];
+};
+
+void flush_traces(struct vm* vm)
+{
+    while (vm->traces)
+    {
+        struct trace* t = vm->traces;
+        vm->traces = t->next;
+        vm->trace_at[t->header] = NULL;
+        free(t);
+    }
+    vm->trace_flush_pending = 0;
+}
+
+// Record by executing from the header until we get back to it. Gives up on
+// TRAPs, reserved opcodes, overlong paths and stores into the path itself;
+// whatever ran so far simply counts as interpreted.
+void record_trace(struct vm* vm, uint16_t header)
+{
+    struct trace_op ops[TRACE_MAX];
+    int n = 0;
+
+    while (n < TRACE_MAX)
+    {
+        uint16_t pc = vm->reg[R_PC];
+        struct trace_op* op = &ops[n];
+        translate_uop(&op->u, pc, vm->memory[pc]);
+        op->pc = pc;
+        if (op->u.kind == U_TRAP || op->u.kind == U_BAD) break;
+
+        int taken = op->u.r0 & cond_flags(vm);
+        vm->code_map[pc >> 3] |= 1 << (pc & 7);
+        step(vm);
+        if (vm->trace_flush_pending) break;
+
+        switch (op->u.kind)
+        {
+            case U_BR:   op->u.kind = taken ? T_GUARD_TAKEN : T_GUARD_NOT_TAKEN; break;
+            case U_JSR:  op->u.kind = T_LINK; break;
+            case U_JMP:  op->u.kind = T_GUARD_JMP;  op->u.imm = vm->reg[R_PC]; break;
+            case U_JSRR: op->u.kind = T_GUARD_JSRR; op->u.imm = vm->reg[R_PC]; break;
+        }
+        ++n;
+
+        if (vm->reg[R_PC] == header)
+        {
+            struct trace* t = malloc(sizeof(struct trace) + n * sizeof(struct trace_op));
+            if (!t) abort();
+            t->header = header;
+            t->length = n;
+            t->next = vm->traces;
+            memcpy(t->ops, ops, n * sizeof(struct trace_op));
+            vm->traces = t;
+            vm->trace_at[header] = t;
+            return;
+        }
+    }
+
+    if (vm->trace_fails[header] < 8) ++vm->trace_fails[header];
+}
+
+// Loop over the trace until a guard fails.
+void execute_trace(struct vm* vm, struct trace* t)
+{
+    struct trace_op* op = t->ops;
+    struct trace_op* end = t->ops + t->length;
+    uint16_t exit_pc;
+    uint16_t reg[8];
+    uint16_t cond;
+    uint64_t count;
+    REGS_LOAD();
+
+#ifdef LC3_COMPUTED_GOTO
+    static void* const trace_table[T_GUARD_JSRR + 1] =
+    {
+        [U_ADD_REG] = &&L_U_ADD_REG, [U_ADD_IMM] = &&L_U_ADD_IMM,
+        [U_AND_REG] = &&L_U_AND_REG, [U_AND_IMM] = &&L_U_AND_IMM,
+        [U_NOT] = &&L_U_NOT, [U_LD] = &&L_U_LD, [U_LDI] = &&L_U_LDI,
+        [U_LDR] = &&L_U_LDR, [U_LEA] = &&L_U_LEA, [U_ST] = &&L_U_ST,
+        [U_STI] = &&L_U_STI, [U_STR] = &&L_U_STR,
+        [T_GUARD_TAKEN] = &&L_T_GUARD_TAKEN,
+        [T_GUARD_NOT_TAKEN] = &&L_T_GUARD_NOT_TAKEN,
+        [T_LINK] = &&L_T_LINK,
+        [T_GUARD_JMP] = &&L_T_GUARD_JMP,
+        [T_GUARD_JSRR] = &&L_T_GUARD_JSRR
+    };
+#define CASE(k)     L_##k
+#define DISPATCH()  goto *trace_table[op->u.kind]
+#else
+#define CASE(k)     case k
+#define DISPATCH()  goto dispatch
+#endif
+#define NEXT()                                      \
+    do                                              \
+    {                                               \
+        if (++op == end)                            \
+        {                                           \
+            count += t->length;                     \
+            op = t->ops;                            \
+            OUTPUT_POLL();                          \
+        }                                           \
+        DISPATCH();                                 \
+    } while (0)
+
+    DISPATCH();
+#ifndef LC3_COMPUTED_GOTO
+dispatch:
+    switch (op->u.kind)
+    {
+#endif
+    CASE(U_ADD_REG):
+        reg[op->u.r0] = reg[op->u.r1] + reg[op->u.r2];
+        cond = reg[op->u.r0];
+        NEXT();
+
+    CASE(U_ADD_IMM):
+        reg[op->u.r0] = reg[op->u.r1] + op->u.imm;
+        cond = reg[op->u.r0];
+        NEXT();
+
+    CASE(U_AND_REG):
+        reg[op->u.r0] = reg[op->u.r1] & reg[op->u.r2];
+        cond = reg[op->u.r0];
+        NEXT();
+
+    CASE(U_AND_IMM):
+        reg[op->u.r0] = reg[op->u.r1] & op->u.imm;
+        cond = reg[op->u.r0];
+        NEXT();
+
+    CASE(U_NOT):
+        reg[op->u.r0] = ~reg[op->u.r1];
+        cond = reg[op->u.r0];
+        NEXT();
+
+    CASE(U_LD):
+        reg[op->u.r0] = GUEST_LOAD(op->u.imm);
+        cond = reg[op->u.r0];
+        NEXT();
+
+    CASE(U_LDI):
+        reg[op->u.r0] = GUEST_LOAD(GUEST_LOAD(op->u.imm));
+        cond = reg[op->u.r0];
+        NEXT();
+
+    CASE(U_LDR):
+        reg[op->u.r0] = GUEST_LOAD(reg[op->u.r1] + op->u.imm);
+        cond = reg[op->u.r0];
+        NEXT();
+
+    CASE(U_LEA):
+        reg[op->u.r0] = op->u.imm;
+        cond = reg[op->u.r0];
+        NEXT();
+
+    CASE(U_ST):
+        GUEST_STORE(op->u.imm, reg[op->u.r0]);
+        if (vm->trace_flush_pending) goto store_exit;
+        NEXT();
+
+    CASE(U_STI):
+        GUEST_STORE(GUEST_LOAD(op->u.imm), reg[op->u.r0]);
+        if (vm->trace_flush_pending) goto store_exit;
+        NEXT();
+
+    CASE(U_STR):
+        GUEST_STORE(reg[op->u.r1] + op->u.imm, reg[op->u.r0]);
+        if (vm->trace_flush_pending) goto store_exit;
+        NEXT();
+
+    CASE(T_GUARD_TAKEN):
+        if (!(op->u.r0 & result_flags(cond)))
+        {
+            exit_pc = op->pc + 1;
+            goto side_exit;
+        }
+        NEXT();
+
+    CASE(T_GUARD_NOT_TAKEN):
+        if (op->u.r0 & result_flags(cond))
+        {
+            exit_pc = op->u.imm;
+            goto side_exit;
+        }
+        NEXT();
+
+    CASE(T_LINK):
+        reg[R_R7] = op->pc + 1;
+        NEXT();
+
+    CASE(T_GUARD_JMP):
+        exit_pc = reg[op->u.r1];
+        if (exit_pc != op->u.imm) goto side_exit;
+        NEXT();
+
+    CASE(T_GUARD_JSRR):
+        exit_pc = reg[op->u.r1];
+        reg[R_R7] = op->pc + 1;
+        if (exit_pc != op->u.imm) goto side_exit;
+        NEXT();
+
+#ifndef LC3_COMPUTED_GOTO
+        default:
+            abort();
+    }
+#endif
+
+store_exit:
+    exit_pc = op->pc + 1;
+side_exit:
+    count += op - t->ops + 1;
+    REGS_SAVE();
+    vm->reg[R_PC] = exit_pc;
+
+#undef CASE
+#undef DISPATCH
+#undef NEXT
+}
+
+void run_trace(struct vm* vm)
+{
+    if (!vm->trace_at)
+    {
+        vm->trace_at = calloc(MEMORY_MAX, sizeof(struct trace*));
+        vm->trace_hot = calloc(MEMORY_MAX, sizeof(uint16_t));
+        vm->trace_fails = calloc(MEMORY_MAX, sizeof(uint8_t));
+        if (!vm->trace_at || !vm->trace_hot || !vm->trace_fails) abort();
+    }
+
+    while (vm->running)
+    {
+        if (vm->trace_flush_pending) flush_traces(vm);
+        output_poll(vm);
+
+        uint16_t pc = vm->reg[R_PC];
+        if (vm->trace_at[pc])
+        {
+            execute_trace(vm, vm->trace_at[pc]);
+            continue;
+        }
+
+        int branch = (vm->memory[pc] >> 12) == OP_BR;
+        step(vm);
+
+        uint16_t target = vm->reg[R_PC];
+        if (branch && target <= pc && !vm->trace_flush_pending
+            && ++vm->trace_hot[target] >= TRACE_HOT << vm->trace_fails[target])
+        {
+            vm->trace_hot[target] = 0;
+            record_trace(vm, target);
+        }
+    }
+}
+
+// X86-64 JIT
+// Template code generator on top of translate_block(). While native code runs
+// guest R0-R7 live in host registers; the last flag-setting result is written
+// back to cond_result at each block exit. Loads and stores go straight to
+// memory[] and only call back into C on pages with a device on them or for a
+// store into translated code.
+#if defined(__x86_64__) && !defined(LC3_NO_JIT)
+#define LC3_JIT 1
+#endif
+
+#ifdef LC3_JIT
+#define JIT_CODE_SIZE (16 << 20)
+
+enum
+{
+    X_RAX = 0, X_RCX, X_RDX, X_RBX, X_RSP, X_RBP, X_RSI, X_RDI,
+    X_R8, X_R9, X_R10, X_R11, X_R12, X_R13, X_R14, X_R15
+};
+
+// Host register for each guest register. rbx points at vm->reg, rbp at the
+// vm (and so at memory[]) and r12 at vm->code_map; rax, rcx, rdx and rsi are
+// scratch.
+const uint8_t jit_host[8] = { X_R8, X_R9, X_R10, X_R11, X_R13, X_R14, X_R15, X_RDI };
+
+// Displacement of a vm field from rbx.
+#define JIT_VM_FIELD(field) ((int32_t)(offsetof(struct vm, field) - offsetof(struct vm, reg)))
+
+void jit_emit8(struct vm* vm, uint8_t x)
+{
+    if (vm->jit_used >= JIT_CODE_SIZE)
+    {
+        vm->jit_overflow = 1;
+        return;
+    }
+    vm->jit_code[vm->jit_used++] = x;
+}
+
+void jit_emit16(struct vm* vm, uint16_t x) { jit_emit8(vm, x); jit_emit8(vm, x >> 8); }
+void jit_emit32(struct vm* vm, uint32_t x) { jit_emit16(vm, x); jit_emit16(vm, x >> 16); }
+void jit_emit64(struct vm* vm, uint64_t x) { jit_emit32(vm, x); jit_emit32(vm, x >> 32); }
+
+void jit_rex(struct vm* vm, int w, int r, int x, int b)
+{
+    uint8_t rex = 0x40 | w << 3 | (r >> 3) << 2 | (x >> 3) << 1 | (b >> 3);
+    if (rex != 0x40) jit_emit8(vm, rex);
+}
+
+void jit_opcode(struct vm* vm, uint32_t op)
+{
+    if (op > 0xFF) jit_emit8(vm, op >> 8);
+    jit_emit8(vm, op);
+}
+
+// op reg, rm with a register operand. o16 adds the operand-size prefix.
+void jit_op_rr(struct vm* vm, int o16, int w, uint32_t op, int reg, int rm)
+{
+    if (o16) jit_emit8(vm, 0x66);
+    jit_rex(vm, w, reg, 0, rm);
+    jit_opcode(vm, op);
+    jit_emit8(vm, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// op reg, [base + index * scale + disp]; index < 0 for none.
+void jit_op_rm(struct vm* vm, int o16, int w, uint32_t op, int reg, int base, int index, int scale, int32_t disp)
+{
+    if (o16) jit_emit8(vm, 0x66);
+    jit_rex(vm, w, reg, index < 0 ? 0 : index, base);
+    jit_opcode(vm, op);
+
+    int mod = disp == 0 && (base & 7) != X_RBP ? 0 : disp >= -128 && disp <= 127 ? 1 : 2;
+    if (index < 0 && (base & 7) != X_RSP)
+    {
+        jit_emit8(vm, mod << 6 | (reg & 7) << 3 | (base & 7));
+    }
+    else
+    {
+        int ss = scale == 8 ? 3 : scale == 4 ? 2 : scale == 2 ? 1 : 0;
+        jit_emit8(vm, mod << 6 | (reg & 7) << 3 | 4);
+        jit_emit8(vm, ss << 6 | ((index < 0 ? X_RSP : index) & 7) << 3 | (base & 7));
+    }
+    if (mod == 1) jit_emit8(vm, disp);
+    if (mod == 2) jit_emit32(vm, disp);
+}
+
+void jit_mov_imm(struct vm* vm, int r, uint32_t imm)
+{
+    jit_rex(vm, 0, 0, 0, r);
+    jit_emit8(vm, 0xB8 + (r & 7));
+    jit_emit32(vm, imm);
+}
+
+void jit_movabs(struct vm* vm, int r, const void* p)
+{
+    jit_rex(vm, 1, 0, 0, r);
+    jit_emit8(vm, 0xB8 + (r & 7));
+    jit_emit64(vm, (uint64_t)(uintptr_t)p);
+}
+
+void jit_call(struct vm* vm, const void* fn)
+{
+    jit_movabs(vm, X_RAX, fn);
+    jit_emit8(vm, 0xFF);
+    jit_emit8(vm, 0xD0);    // call rax
+}
+
+// Forward jumps: emit with a zero displacement and patch once the target is known.
+size_t jit_jcc(struct vm* vm, uint8_t cc)
+{
+    jit_emit8(vm, 0x0F);
+    jit_emit8(vm, 0x80 | cc);
+    jit_emit32(vm, 0);
+    return vm->jit_used;
+}
+
+size_t jit_jmp(struct vm* vm)
+{
+    jit_emit8(vm, 0xE9);
+    jit_emit32(vm, 0);
+    return vm->jit_used;
+}
+
+void jit_land(struct vm* vm, size_t after)
+{
+    if (vm->jit_overflow) return;
+    int32_t rel = (int32_t)(vm->jit_used - after);
+    memcpy(vm->jit_code + after - 4, &rel, 4);
+}
+
+void jit_jmp_to(struct vm* vm, uint8_t* target)
+{
+    jit_emit8(vm, 0xE9);
+    jit_emit32(vm, (uint32_t)(target - (vm->jit_code + vm->jit_used + 4)));
+}
+
+enum { CC_E = 0x4, CC_NE = 0x5, CC_S = 0x8, CC_NS = 0x9, CC_LE = 0xE, CC_G = 0xF, CC_AE = 0x3, CC_B = 0x2 };
+
+// Condition that is true for a BR nzp mask after "test r, r".
+const uint8_t jit_br_cc[8] = { 0, CC_G, CC_E, CC_NS, CC_S, CC_NE, CC_LE, 0 };
+
+void jit_spill(struct vm* vm)
+{
+    for (int g = 0; g < 8; ++g)
+    {
+        jit_op_rm(vm, 1, 0, 0x89, jit_host[g], X_RBX, -1, 0, 2 * g);
+    }
+}
+
+void jit_reload(struct vm* vm)
+{
+    for (int g = 0; g < 8; ++g)
+    {
+        jit_op_rm(vm, 0, 0, 0x0FB7, jit_host[g], X_RBX, -1, 0, 2 * g);
+    }
+}
+
+// vm->cond_result = guest register g
+void jit_store_flags(struct vm* vm, int g)
+{
+    jit_op_rm(vm, 1, 0, 0x89, jit_host[g], X_RBX, -1, 0, JIT_VM_FIELD(cond_result));
+}
+
+void jit_count(struct vm* vm, int64_t n)
+{
+    if (n == 0) return;
+    jit_op_rm(vm, 0, 1, 0x81, 0, X_RBX, -1, 0, JIT_VM_FIELD(instr_count));
+    jit_emit32(vm, (uint32_t)n);
+}
+
+// First two arguments of a call back into C: rdi = vm, esi = eax.
+void jit_call_args(struct vm* vm)
+{
+    jit_op_rr(vm, 0, 0, 0x89, X_RAX, X_RSI);
+    jit_op_rr(vm, 0, 1, 0x89, X_RBP, X_RDI);
+}
+
+// Leave native code with eax = next PC and nothing to link.
+void jit_exit_plain(struct vm* vm)
+{
+    jit_emit8(vm, 0x31);
+    jit_emit8(vm, 0xD2);    // xor edx, edx
+    jit_jmp_to(vm, vm->jit_exit_common);
+}
+
+// Leave for a known target. The leading jmp falls through to the return
+// sequence until run_jit() links it straight to the target's code.
+void jit_exit_direct(struct vm* vm, uint16_t target)
+{
+    jit_emit8(vm, 0xE9);
+    jit_emit32(vm, 0);
+    jit_mov_imm(vm, X_RAX, target);
+    jit_emit8(vm, 0x48);
+    jit_emit8(vm, 0x8D);
+    jit_emit8(vm, 0x15);
+    jit_emit32(vm, (uint32_t)-17);  // lea rdx, [the jmp above]
+    jit_jmp_to(vm, vm->jit_exit_common);
+}
+
+// Leave for the target in eax, jumping straight there if it is compiled.
+void jit_exit_indirect(struct vm* vm)
+{
+    jit_movabs(vm, X_RCX, vm->jit_entry_at);
+    jit_op_rm(vm, 0, 1, 0x8B, X_RCX, X_RCX, X_RAX, 8, 0);
+    jit_op_rr(vm, 0, 1, 0x85, X_RCX, X_RCX);
+    size_t miss = jit_jcc(vm, CC_E);
+    jit_emit8(vm, 0xFF);
+    jit_emit8(vm, 0xE1);    // jmp rcx
+    jit_land(vm, miss);
+    jit_exit_plain(vm);
+}
+
+#ifndef LC3_HOST_MMU
+// Set ZF unless the page of address eax has a device on it. With
+// LC3_HOST_MMU the host faults on those pages instead.
+void jit_device_check(struct vm* vm)
+{
+    jit_op_rr(vm, 0, 0, 0x89, X_RAX, X_RCX);
+    jit_op_rr(vm, 0, 0, 0xC1, 5, X_RCX);
+    jit_emit8(vm, PAGE_BITS);                           // shr ecx, PAGE_BITS
+    jit_op_rm(vm, 0, 0, 0x80, 7, X_RBX, X_RCX, 1, JIT_VM_FIELD(device_page));
+    jit_emit8(vm, 0);                                   // cmp byte [device_page + rcx], 0
+}
+#endif
+
+// eax = mem_read(vm, eax)
+void jit_load_eax(struct vm* vm)
+{
+#ifdef LC3_HOST_MMU
+    // The registers go back for KBSR only; see regs_load_word().
+    jit_emit8(vm, 0x3D);
+    jit_emit32(vm, MR_KBSR);                            // cmp eax, MR_KBSR
+    size_t other = jit_jcc(vm, CC_NE);
+    jit_spill(vm);
+    jit_land(vm, other);
+    jit_op_rm(vm, 0, 0, 0x0FB7, X_RAX, X_RBP, X_RAX, 2, 0);
+#else
+    jit_device_check(vm);
+    size_t slow = jit_jcc(vm, CC_NE);
+    jit_op_rm(vm, 0, 0, 0x0FB7, X_RAX, X_RBP, X_RAX, 2, 0);
+    size_t done = jit_jmp(vm);
+    jit_land(vm, slow);
+    jit_spill(vm);
+    jit_call_args(vm);
+    jit_call(vm, mem_read);
+    jit_op_rr(vm, 0, 0, 0x0FB7, X_RAX, X_RAX);
+    jit_reload(vm);
+    jit_land(vm, done);
+#endif
+}
+
+uint32_t jit_trap(struct vm* vm, uint16_t vector)
+{
+    execute_trap(vm, vector);
+    return vm->running;
+}
+
+// mem_write(vm, eax, guest g). A store into translated code or into a page
+// with a device leaves the block right after the store so run_jit() can flush
+// stale code.
+void jit_store_eax(struct vm* vm, int g, uint16_t next_pc, int remaining, int flag_guest)
+{
+#ifndef LC3_HOST_MMU
+    jit_device_check(vm);
+    size_t device = jit_jcc(vm, CC_NE);
+#endif
+    jit_op_rm(vm, 1, 0, 0x89, jit_host[g], X_RBP, X_RAX, 2, 0);
+    jit_op_rr(vm, 0, 0, 0x89, X_RAX, X_RCX);
+    jit_op_rr(vm, 0, 0, 0xC1, 5, X_RCX);
+    jit_emit8(vm, PAGE_BITS);
+    jit_op_rm(vm, 0, 0, 0x8B, X_RDX, X_RBX, -1, 0, JIT_VM_FIELD(clock));
+    jit_op_rm(vm, 0, 0, 0x89, X_RDX, X_RBX, X_RCX, 4, JIT_VM_FIELD(page_stamp));
+    jit_op_rm(vm, 0, 0, 0xFF, 0, X_RBX, -1, 0, JIT_VM_FIELD(stores));     // inc
+    jit_op_rm(vm, 0, 0, 0x0FA3, X_RAX, X_R12, -1, 0, 0);   // bt [code_map], eax
+    size_t done = jit_jcc(vm, CC_AE);
+    jit_spill(vm);
+    jit_call_args(vm);
+    jit_call(vm, invalidate_code);
+#ifndef LC3_HOST_MMU
+    size_t leave = jit_jmp(vm);
+    jit_land(vm, device);
+    jit_spill(vm);
+    jit_call_args(vm);
+    jit_op_rm(vm, 0, 0, 0x0FB7, X_RDX, X_RBX, -1, 0, 2 * g);
+    jit_call(vm, mem_write);
+    jit_land(vm, leave);
+#endif
+    jit_reload(vm);
+    if (flag_guest >= 0) jit_store_flags(vm, flag_guest);
+    jit_count(vm, -remaining);
+    jit_mov_imm(vm, X_RAX, next_pc);
+    jit_exit_plain(vm);
+    jit_land(vm, done);
+}
+
+// eax = guest g + imm, wrapped to 16 bits
+void jit_address(struct vm* vm, int g, uint16_t imm)
+{
+    jit_op_rr(vm, 0, 0, 0x0FB7, X_RAX, jit_host[g]);
+    if (imm)
+    {
+        jit_op_rr(vm, 1, 0, 0x83, 0, X_RAX);
+        jit_emit8(vm, imm);
+        jit_op_rr(vm, 0, 0, 0x0FB7, X_RAX, X_RAX);
+    }
+}
+
+// dst = src (16 bits) unless they are the same register
+void jit_copy(struct vm* vm, int dst, int src)
+{
+    if (dst != src) jit_op_rr(vm, 1, 0, 0x89, jit_host[src], jit_host[dst]);
+}
+
+// The code buffer is writable only while code is emitted or a chain is
+// patched, and executable otherwise, so it works where W+X mappings are
+// refused. Returns 0 if the host will not make it executable.
+int jit_protect(struct vm* vm, int writable)
+{
+    if (vm->jit_writable == writable) return 1;
+    if (mprotect(vm->jit_code, JIT_CODE_SIZE, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) != 0)
+    {
+        return 0;
+    }
+    vm->jit_writable = writable;
+    return 1;
+}
+
+int jit_init(struct vm* vm)
+{
+    if (vm->jit_code) return 1;
+    void* p = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return 0;
+    vm->jit_code = p;
+    vm->jit_writable = 1;
+    if (!jit_protect(vm, 0) || !jit_protect(vm, 1))
+    {
+        munmap(p, JIT_CODE_SIZE);
+        vm->jit_code = NULL;
+        return 0;
+    }
+    vm->jit_entry_at = calloc(MEMORY_MAX, sizeof(uint8_t*));
+    if (!vm->jit_entry_at) abort();
+
+    // uint32_t jit_enter(vm, code)
+    vm->jit_enter = (void*)vm->jit_code;
+    jit_emit8(vm, 0x53);                                // push rbx
+    jit_emit8(vm, 0x55);                                // push rbp
+    jit_emit8(vm, 0x41); jit_emit8(vm, 0x54);           // push r12
+    jit_emit8(vm, 0x41); jit_emit8(vm, 0x55);           // push r13
+    jit_emit8(vm, 0x41); jit_emit8(vm, 0x56);           // push r14
+    jit_emit8(vm, 0x41); jit_emit8(vm, 0x57);           // push r15
+    jit_emit8(vm, 0x48); jit_emit8(vm, 0x83); jit_emit8(vm, 0xEC); jit_emit8(vm, 0x08);   // sub rsp, 8
+    jit_op_rr(vm, 0, 1, 0x89, X_RDI, X_RBP);
+    jit_op_rm(vm, 0, 1, 0x8D, X_RBX, X_RDI, -1, 0, offsetof(struct vm, reg));         // lea rbx, [rdi + reg]
+    jit_op_rm(vm, 0, 1, 0x8D, X_R12, X_RDI, -1, 0, offsetof(struct vm, code_map));    // lea r12, [rdi + code_map]
+    jit_reload(vm);
+    jit_emit8(vm, 0xFF);
+    jit_emit8(vm, 0xE6);                                // jmp rsi
+
+    // Common exit: eax = next PC, rdx = direct exit site or 0.
+    vm->jit_exit_common = vm->jit_code + vm->jit_used;
+    jit_op_rm(vm, 0, 1, 0x89, X_RDX, X_RBX, -1, 0, JIT_VM_FIELD(jit_exit_site));
+    jit_spill(vm);
+    jit_emit8(vm, 0x48); jit_emit8(vm, 0x83); jit_emit8(vm, 0xC4); jit_emit8(vm, 0x08);   // add rsp, 8
+    jit_emit8(vm, 0x41); jit_emit8(vm, 0x5F);           // pop r15
+    jit_emit8(vm, 0x41); jit_emit8(vm, 0x5E);           // pop r14
+    jit_emit8(vm, 0x41); jit_emit8(vm, 0x5D);           // pop r13
+    jit_emit8(vm, 0x41); jit_emit8(vm, 0x5C);           // pop r12
+    jit_emit8(vm, 0x5D);                                // pop rbp
+    jit_emit8(vm, 0x5B);                                // pop rbx
+    jit_emit8(vm, 0xC3);                                // ret
+
+    vm->jit_base = vm->jit_used;
+    vm->jit_epoch = vm->block_epoch;
+    return 1;
+}
+
+void jit_flush(struct vm* vm)
+{
+    vm->jit_used = vm->jit_base;
+    memset(vm->jit_entry_at, 0, MEMORY_MAX * sizeof(uint8_t*));
+    vm->jit_epoch = vm->block_epoch;
+    ++vm->jit_generation;
+}
+
+uint8_t* jit_compile(struct vm* vm, uint16_t pc)
+{
+    struct block* b = find_block(vm, pc);
+    if (b->ops[0].kind == U_BAD) return NULL;
+
+    if (!jit_protect(vm, 1)) abort();
+    size_t start = vm->jit_used;
+    int flag_guest = -1;    // guest register holding the last flag-setting result
+    int executed = b->length;
+    vm->jit_overflow = 0;
+
+    for (int i = 0; ; ++i)
+    {
+        if (b->ops[i].kind == U_BAD)
+        {
+            --executed;
+            break;
+        }
+        if (b->ops[i].kind >= U_BR) break;
+    }
+    // Back to run_jit() to let output_tick() look at the clock, once
+    // instr_count reaches output_check; links make that the only way out of
+    // a loop that never traps.
+    jit_op_rm(vm, 0, 1, 0x8B, X_RAX, X_RBX, -1, 0, JIT_VM_FIELD(instr_count));
+    jit_op_rm(vm, 0, 1, 0x3B, X_RAX, X_RBX, -1, 0, JIT_VM_FIELD(output_check));
+    size_t early = jit_jcc(vm, CC_B);
+    jit_mov_imm(vm, X_RAX, b->start);
+    jit_exit_plain(vm);
+    jit_land(vm, early);
+    jit_count(vm, executed);
+
+    for (int i = 0; ; ++i)
+    {
+        struct uop* u = &b->ops[i];
+        uint16_t next_pc = b->start + i + 1;
+        int remaining = executed - i - 1;
+
+        if (u->kind >= U_BR && flag_guest >= 0)
+        {
+            jit_store_flags(vm, flag_guest);
+        }
+
+        switch (u->kind)
+        {
+            case U_ADD_REG:
+            case U_AND_REG:
+                {
+                    uint8_t op = u->kind == U_ADD_REG ? 0x01 : 0x21;
+                    int other = u->r2;
+                    if (u->r0 == u->r2 && u->r0 != u->r1) other = u->r1;
+                    else jit_copy(vm, u->r0, u->r1);
+                    jit_op_rr(vm, 1, 0, op, jit_host[other], jit_host[u->r0]);
+                    flag_guest = u->r0;
+                }
+                continue;
+
+            case U_ADD_IMM:
+            case U_AND_IMM:
+                jit_copy(vm, u->r0, u->r1);
+                jit_op_rr(vm, 1, 0, 0x83, u->kind == U_ADD_IMM ? 0 : 4, jit_host[u->r0]);
+                jit_emit8(vm, u->imm);
+                flag_guest = u->r0;
+                continue;
+
+            case U_NOT:
+                jit_copy(vm, u->r0, u->r1);
+                jit_op_rr(vm, 1, 0, 0xF7, 2, jit_host[u->r0]);
+                flag_guest = u->r0;
+                continue;
+
+            case U_LEA:
+                jit_mov_imm(vm, jit_host[u->r0], u->imm);
+                flag_guest = u->r0;
+                continue;
+
+            case U_LD:
+                if (!vm->device_page[u->imm >> PAGE_BITS])
+                {
+                    jit_op_rm(vm, 0, 0, 0x0FB7, jit_host[u->r0], X_RBP, -1, 0, 2 * u->imm);
+                }
+                else
+                {
+                    jit_mov_imm(vm, X_RAX, u->imm);
+                    jit_load_eax(vm);
+                    jit_op_rr(vm, 0, 0, 0x89, X_RAX, jit_host[u->r0]);
+                }
+                flag_guest = u->r0;
+                continue;
+
+            case U_LDI:
+                jit_mov_imm(vm, X_RAX, u->imm);
+                jit_load_eax(vm);
+                jit_load_eax(vm);
+                jit_op_rr(vm, 0, 0, 0x89, X_RAX, jit_host[u->r0]);
+                flag_guest = u->r0;
+                continue;
+
+            case U_LDR:
+                jit_address(vm, u->r1, u->imm);
+                jit_load_eax(vm);
+                jit_op_rr(vm, 0, 0, 0x89, X_RAX, jit_host[u->r0]);
+                flag_guest = u->r0;
+                continue;
+
+            case U_ST:
+                jit_mov_imm(vm, X_RAX, u->imm);
+                jit_store_eax(vm, u->r0, next_pc, remaining, flag_guest);
+                continue;
+
+            case U_STI:
+                jit_mov_imm(vm, X_RAX, u->imm);
+                jit_load_eax(vm);
+                jit_store_eax(vm, u->r0, next_pc, remaining, flag_guest);
+                continue;
+
+            case U_STR:
+                jit_address(vm, u->r1, u->imm);
+                jit_store_eax(vm, u->r0, next_pc, remaining, flag_guest);
+                continue;
+
+            case U_BR:
+                {
+                    uint8_t mask = u->r0;
+                    if (mask == 0)
+                    {
+                        jit_exit_direct(vm, next_pc);
+                        break;
+                    }
+                    if (mask == 7)
+                    {
+                        jit_exit_direct(vm, u->imm);
+                        break;
+                    }
+
+                    if (flag_guest >= 0)
+                    {
+                        jit_op_rr(vm, 1, 0, 0x85, jit_host[flag_guest], jit_host[flag_guest]);
+                    }
+                    else
+                    {
+                        jit_op_rm(vm, 0, 0, 0x0FB7, X_RCX, X_RBX, -1, 0, JIT_VM_FIELD(cond_result));
+                        jit_op_rr(vm, 1, 0, 0x85, X_RCX, X_RCX);
+                    }
+                    size_t taken = jit_jcc(vm, jit_br_cc[mask]);
+                    jit_exit_direct(vm, next_pc);
+                    jit_land(vm, taken);
+                    jit_exit_direct(vm, u->imm);
+                }
+                break;
+
+            case U_JMP:
+                jit_op_rr(vm, 0, 0, 0x0FB7, X_RAX, jit_host[u->r1]);
+                jit_exit_indirect(vm);
+                break;
+
+            case U_JSR:
+                jit_mov_imm(vm, jit_host[R_R7], next_pc);
+                jit_exit_direct(vm, u->imm);
+                break;
+
+            case U_JSRR:
+                jit_op_rr(vm, 0, 0, 0x0FB7, X_RAX, jit_host[u->r1]);
+                jit_mov_imm(vm, jit_host[R_R7], next_pc);
+                jit_exit_indirect(vm);
+                break;
+
+            case U_TRAP:
+                {
+                    jit_op_rm(vm, 1, 0, 0xC7, 0, X_RBX, -1, 0, 2 * R_PC);
+                    jit_emit16(vm, next_pc);
+                    jit_spill(vm);
+                    jit_mov_imm(vm, X_RAX, u->imm);
+                    jit_call_args(vm);
+                    jit_call(vm, jit_trap);
+                    jit_reload(vm);
+                    jit_op_rr(vm, 0, 0, 0x85, X_RAX, X_RAX);
+                    size_t resume = jit_jcc(vm, CC_NE);
+                    jit_mov_imm(vm, X_RAX, next_pc);
+                    jit_exit_plain(vm);
+                    jit_land(vm, resume);
+                    jit_exit_direct(vm, next_pc);
+                }
+                break;
+
+            case U_BAD:
+                // Leave it to step() so it fails exactly as the interpreter does.
+                jit_mov_imm(vm, X_RAX, next_pc - 1);
+                jit_exit_plain(vm);
+                break;
+
+            case U_END:
+                jit_exit_direct(vm, next_pc);
+                break;
+        }
+        break;
+    }
+
+    if (vm->jit_overflow)
+    {
+        vm->jit_used = start;
+        return NULL;
+    }
+    vm->jit_entry_at[pc] = vm->jit_code + start;
+    return vm->jit_code + start;
+}
+
+uint8_t* jit_lookup(struct vm* vm, uint16_t pc)
+{
+    uint8_t* code = vm->jit_entry_at[pc];
+    if (!code)
+    {
+        code = jit_compile(vm, pc);
+        if (!code && vm->jit_overflow)
+        {
+            jit_flush(vm);
+            code = jit_compile(vm, pc);
+        }
+    }
+    return code;
+}
+#endif
+
+// JIT DISPATCH
+// Only enters C between native blocks that are not linked yet, on traps and
+// on stores into code. Falls back to the block engine where there is no JIT.
+void run_jit(struct vm* vm)
+{
+#ifdef LC3_JIT
+    if (!jit_init(vm))
+    {
+        run_blocks(vm);
+        return;
+    }
+
+    while (vm->running)
+    {
+        if (vm->jit_epoch != vm->block_epoch) jit_flush(vm);
+        output_poll(vm);
+
+        uint8_t* code = jit_lookup(vm, vm->reg[R_PC]);
+        if (!code)
+        {
+            step(vm);
+            continue;
+        }
+        if (!jit_protect(vm, 0)) abort();
+        vm->reg[R_PC] = vm->jit_enter(vm, code);
+
+        // Link the direct exit we left through, so next time it stays native.
+        uint8_t* site = vm->jit_exit_site;
+        uint32_t generation = vm->jit_generation;
+        if (site && vm->running && vm->jit_epoch == vm->block_epoch)
+        {
+            uint8_t* target = jit_lookup(vm, vm->reg[R_PC]);
+            if (target && generation == vm->jit_generation && jit_protect(vm, 1))
+            {
+                int32_t rel = (int32_t)(target - (site + 5));
+                memcpy(site + 1, &rel, 4);
+            }
+        }
+    }
+#else
+    run_blocks(vm);
+#endif
+}
+
+// AHEAD-OF-TIME RECOMPILER
+// --aot=FILE writes the loaded image out as C instead of running it. Every
+// address reachable from the entry point becomes a label in one function:
+// branches and JSR turn into gotos, JMP/JSRR/RET go through a switch over the
+// labels, and guest registers live in locals. A JMP or JSRR through a register
+// set from LEA, LD or LDR earlier in the same straight-line run makes the
+// address it holds a way in too; other addresses the image takes or loads are
+// left as data. The file defines LC3_AOT and includes lc3.c for traps, memory
+// and the interpreter, which runs anything without a label and any label
+// whose words the guest has stored into.
+struct aot_segment
+{
+    uint16_t origin;
+    int length;
+    const uint16_t* words;
+};
+
+uint8_t aot_reached[MEMORY_MAX / 8];    // words compiled
+uint8_t aot_leader[MEMORY_MAX / 8];     // words that get a label
+uint16_t aot_pending[MEMORY_MAX];       // leaders not walked yet
+int aot_pending_count = 0;
+
+int aot_test(const uint8_t* map, uint16_t address)
+{
+    return (map[address >> 3] >> (address & 7)) & 1;
+}
+
+void aot_set(uint8_t* map, uint16_t address)
+{
+    map[address >> 3] |= 1 << (address & 7);
+}
+
+void aot_root(uint16_t pc)
+{
+    if (aot_test(aot_leader, pc)) return;
+    aot_set(aot_leader, pc);
+    aot_pending[aot_pending_count++] = pc;
+}
+
+// Does control ever go on to the next word after this instruction?
+int aot_falls_through(uint16_t instr)
+{
+    switch (instr >> 12)
+    {
+        case OP_BR:   return ((instr >> 9) & 0x7) != 0x7;
+        case OP_TRAP: return (instr & 0xFF) != TRAP_HALT;
+        case OP_JMP:
+        case OP_JSR:
+        case OP_RTI:
+        case OP_RES:  return 0;
+        default:      return 1;
+    }
+}
+
+// Follow straight-line code from pc, queueing every other way in. Registers
+// set to a constant along the way are followed, so that a JMP or JSRR through
+// one can queue its target.
+void aot_walk(struct vm* vm, uint16_t pc)
+{
+    int known[8] = { 0 };
+    uint16_t value[8] = { 0 };
+    while (!aot_test(aot_reached, pc))
+    {
+        aot_set(aot_reached, pc);
+        uint16_t instr = vm->memory[pc];
+        uint16_t next = pc + 1;
+        int dr = (instr >> 9) & 0x7;
+        int sr = (instr >> 6) & 0x7;
+
+        switch (instr >> 12)
+        {
+            case OP_BR:
+                if ((instr >> 9) & 0x7)
+                {
+                    aot_root(next + sign_extend(instr & 0x1FF, 9));
+                    aot_root(next);
+                }
+                break;
+
+            case OP_JSR:
+                if ((instr >> 11) & 1) aot_root(next + sign_extend(instr & 0x7FF, 11));
+                else if (known[sr]) aot_root(value[sr]);
+                aot_root(next);     // where RET comes back to
+                break;
+
+            case OP_JMP:
+                if (known[sr]) aot_root(value[sr]);
+                break;
+        }
+
+        switch (instr >> 12)
+        {
+            case OP_ADD:
+                // Only ADD DR, SR, #imm keeps a constant one.
+                known[dr] = known[sr] && ((instr >> 5) & 1);
+                value[dr] = value[sr] + sign_extend(instr & 0x1F, 5);
+                break;
+
+            case OP_LEA:
+                known[dr] = 1;
+                value[dr] = next + sign_extend(instr & 0x1FF, 9);
+                break;
+
+            case OP_LD:
+                known[dr] = 1;
+                value[dr] = vm->memory[(uint16_t)(next + sign_extend(instr & 0x1FF, 9))];
+                break;
+
+            case OP_LDR:
+                known[dr] = known[sr];
+                value[dr] = vm->memory[(uint16_t)(value[sr] + sign_extend(instr & 0x3F, 6))];
+                break;
+
+            case OP_AND:
+            case OP_NOT:
+            case OP_LDI:
+                known[dr] = 0;
+                break;
+
+            case OP_TRAP:
+                known[R_R0] = 0;
+                known[R_R7] = 0;
+                break;
+        }
+        if (!aot_falls_through(instr)) return;
+        if (next == 0)
+        {
+            aot_root(0);    // wrapped; needs a label to jump back to
+            return;
+        }
+        pc = next;
+    }
+}
+
+const char* aot_conditions[8] =
+{
+    "", "(int16_t)cond > 0", "cond == 0", "(int16_t)cond >= 0",
+    "(int16_t)cond < 0", "cond != 0", "(int16_t)cond <= 0", ""
+};
+
+// One instruction; rest is how many more the enclosing label counted.
+void aot_emit_instr(struct vm* vm, FILE* out, uint16_t pc, int rest)
+{
+    uint16_t instr = vm->memory[pc];
+    uint16_t next = pc + 1;
+    int r0 = (instr >> 9) & 0x7;
+    int r1 = (instr >> 6) & 0x7;
+    int r2 = instr & 0x7;
+    uint16_t offset9 = next + sign_extend(instr & 0x1FF, 9);
+    uint16_t imm5 = sign_extend(instr & 0x1F, 5);
+    uint16_t imm6 = sign_extend(instr & 0x3F, 6);
+
+    switch (instr >> 12)
+    {
+        case OP_ADD:
+        case OP_AND:
+            {
+                char op = (instr >> 12) == OP_ADD ? '+' : '&';
+                if ((instr >> 5) & 0x1)
+                    fprintf(out, "    r%d = r%d %c 0x%04X; cond = r%d;\n", r0, r1, op, imm5, r0);
+                else
+                    fprintf(out, "    r%d = r%d %c r%d; cond = r%d;\n", r0, r1, op, r2, r0);
+            }
+            break;
+
+        case OP_NOT: fprintf(out, "    r%d = ~r%d; cond = r%d;\n", r0, r1, r0); break;
+        case OP_LD:  fprintf(out, "    r%d = LOAD(0x%04X); cond = r%d;\n", r0, offset9, r0); break;
+        case OP_LDI: fprintf(out, "    { uint16_t address = LOAD(0x%04X); r%d = LOAD(address); cond = r%d; }\n", offset9, r0, r0); break;
+        case OP_LDR: fprintf(out, "    r%d = LOAD((uint16_t)(r%d + 0x%04X)); cond = r%d;\n", r0, r1, imm6, r0); break;
+        case OP_LEA: fprintf(out, "    r%d = 0x%04X; cond = r%d;\n", r0, offset9, r0); break;
+        case OP_ST:  fprintf(out, "    STORE(0x%04X, r%d, 0x%04X, %d);\n", offset9, r0, next, rest); break;
+        case OP_STI: fprintf(out, "    STORE(LOAD(0x%04X), r%d, 0x%04X, %d);\n", offset9, r0, next, rest); break;
+        case OP_STR: fprintf(out, "    STORE(r%d + 0x%04X, r%d, 0x%04X, %d);\n", r1, imm6, r0, next, rest); break;
+        case OP_JMP: fprintf(out, "    pc = r%d; goto dispatch;\n", r1); break;
+        case OP_TRAP: fprintf(out, "    TRAP(0x%04X, 0x%04X, %d);\n", instr, next, rest); break;
+
+        case OP_BR:
+            if (((instr >> 9) & 0x7) == 0x7)
+                fprintf(out, "    goto L_%04X;\n", offset9);
+            else if ((instr >> 9) & 0x7)
+                fprintf(out, "    if (%s) goto L_%04X;\n", aot_conditions[(instr >> 9) & 0x7], offset9);
+            break;
+
+        case OP_JSR:
+            if ((instr >> 11) & 1)
+                fprintf(out, "    r7 = 0x%04X; goto L_%04X;\n", next, (uint16_t)(next + sign_extend(instr & 0x7FF, 11)));
+            else
+                fprintf(out, "    pc = r%d; r7 = 0x%04X; goto dispatch;\n", r1, next);
+            break;
+
+        default:
+            // Reserved opcode: leave it to the interpreter, uncounted.
+            fprintf(out, "    vm->instr_count -= %d; pc = 0x%04X; goto leave;\n", rest + 1, pc);
+            break;
+    }
+}
+
+void aot_emit_map(FILE* out, const char* name, const uint8_t* map)
+{
+    fprintf(out, "const uint8_t %s[MEMORY_MAX / 8] =\n{", name);
+    int column = 0;
+    for (int i = 0; i < MEMORY_MAX / 8; ++i)
+    {
+        if (!map[i]) continue;
+        fprintf(out, "%s[0x%04X] = 0x%02X,", column++ % 6 ? " " : "\n    ", i, map[i]);
+    }
+    fprintf(out, "\n};\n\n");
+}
+
+// Runs of non-zero or compiled words, split at gaps of 8 unused words.
+int aot_find_segments(struct vm* vm, struct aot_segment* segments)
+{
+    int count = 0;
+    int start = -1;
+    for (int a = 0; a <= MEMORY_MAX; ++a)
+    {
+        int used = a < MEMORY_MAX && (vm->memory[a] || aot_test(aot_reached, a));
+        if (used && start < 0) start = a;
+        if (used || start < 0) continue;
+
+        int gap = 0;
+        while (a + gap < MEMORY_MAX && gap < 8 && !vm->memory[a + gap] && !aot_test(aot_reached, a + gap)) ++gap;
+        if (gap < 8 && a + gap < MEMORY_MAX) continue;
+
+        segments[count].origin = start;
+        segments[count].length = a - start;
+        segments[count].words = vm->memory + start;
+        ++count;
+        start = -1;
+    }
+    return count;
+}
+
+void aot_emit_image(struct vm* vm, FILE* out)
+{
+    static struct aot_segment segments[MEMORY_MAX / 9 + 1];
+    int count = aot_find_segments(vm, segments);
+
+    for (int s = 0; s < count; ++s)
+    {
+        fprintf(out, "const uint16_t aot_words_%04X[] =\n{", segments[s].origin);
+        for (int i = 0; i < segments[s].length; ++i)
+        {
+            fprintf(out, "%s0x%04X,", i % 10 ? " " : "\n    ", segments[s].words[i]);
+        }
+        fprintf(out, "\n};\n\n");
+    }
+
+    fprintf(out, "const struct aot_segment aot_segments[] =\n{\n");
+    for (int s = 0; s < count; ++s)
+    {
+        fprintf(out, "    { 0x%04X, %d, aot_words_%04X },\n",
+                segments[s].origin, segments[s].length, segments[s].origin);
+    }
+    fprintf(out, "};\n\nconst int aot_segment_count = %d;\n\n", count);
+}
+
+// Instructions counted at the label on pc: up to the next label or the first
+// instruction that does not fall through.
+int aot_block_length(struct vm* vm, uint16_t pc)
+{
+    int n = 1;
+    while (aot_falls_through(vm->memory[pc]) && !aot_test(aot_leader, ++pc)) ++n;
+    return n;
+}
+
+int aot_emit(struct vm* vm, const char* path, uint16_t entry)
+{
+    FILE* out = fopen(path, "w");
+    if (!out) return 0;
+#ifdef LC3_HOST_MMU
+    mmu_protect(vm, 0);     // the walk and the image read memory as it is
+#endif
+
+    memset(aot_reached, 0, sizeof(aot_reached));
+    memset(aot_leader, 0, sizeof(aot_leader));
+    aot_pending_count = 0;
+    aot_root(entry);
+    while (aot_pending_count > 0)
+    {
+        aot_walk(vm, aot_pending[--aot_pending_count]);
+    }
+
+    fprintf(out,
+        "// Written by lc3-vm --aot; regenerate rather than edit.\n"
+        "// Build with lc3.c on the include path: gcc -O2 -I<lc3.c dir> %s\n"
+        "#define LC3_AOT\n"
+        "#include \"lc3.c\"\n\n", path);
+    aot_emit_image(vm, out);
+    aot_emit_map(out, "aot_code", aot_reached);
+    aot_emit_map(out, "aot_entry", aot_leader);
+
+    fprintf(out,
+        "// Guest registers live in locals; traps and the interpreter use vm->reg.\n"
+        "#define SPILL() (vm->reg[R_R0] = r0, vm->reg[R_R1] = r1, vm->reg[R_R2] = r2, vm->reg[R_R3] = r3, \\\n"
+        "                 vm->reg[R_R4] = r4, vm->reg[R_R5] = r5, vm->reg[R_R6] = r6, vm->reg[R_R7] = r7, vm->cond_result = cond)\n"
+        "#define RELOAD() (r0 = vm->reg[R_R0], r7 = vm->reg[R_R7], cond = vm->cond_result)\n"
+        "// A device sees the registers as the guest has them.\n"
+        "#define LOAD(address) \\\n"
+        "    (vm->device_page[(address) >> PAGE_BITS] ? (SPILL(), mem_read(vm, (address))) : mem_read(vm, (address)))\n\n"
+        "// Labels whose code was stored into are left to the interpreter, so a\n"
+        "// store into code leaves to check whether the rest of its block still holds.\n"
+        "#define ENTER(label, count) \\\n"
+        "    do { if (vm->aot_dead[label]) { pc = (label); goto leave; } vm->instr_count += (count); \\\n"
+        "         if (vm->instr_count >= vm->output_check) output_tick(vm); } while (0)\n\n"
+        "#define STORE(address, value, next, rest) \\\n"
+        "    do { mem_write(vm, (address), (value)); \\\n"
+        "         if (vm->aot_hit) { vm->aot_hit = 0; vm->instr_count -= (rest); pc = (next); goto dispatch; } } while (0)\n\n"
+        "#define TRAP(instr, next, rest) \\\n"
+        "    do { SPILL(); vm->reg[R_PC] = (next); execute_trap(vm, instr); RELOAD(); \\\n"
+        "         if (!vm->running) { vm->instr_count -= (rest); return; } } while (0)\n\n"
+        "void aot_run(struct vm* vm)\n"
+        "{\n"
+        "    uint16_t r0 = vm->reg[R_R0], r1 = vm->reg[R_R1], r2 = vm->reg[R_R2], r3 = vm->reg[R_R3];\n"
+        "    uint16_t r4 = vm->reg[R_R4], r5 = vm->reg[R_R5], r6 = vm->reg[R_R6], r7 = vm->reg[R_R7];\n"
+        "    uint16_t cond = vm->cond_result;\n"
+        "    uint16_t pc = vm->reg[R_PC];\n\n"
+        "dispatch:\n"
+        "    switch (pc)\n"
+        "    {\n");
+    for (int a = 0; a < MEMORY_MAX; ++a)
+    {
+        if (aot_test(aot_leader, a)) fprintf(out, "        case 0x%04X: goto L_%04X;\n", a, a);
+    }
+    fprintf(out,
+        "        default: goto leave;\n"
+        "    }\n\n"
+        "leave:\n"
+        "    SPILL();\n"
+        "    vm->reg[R_PC] = pc;\n"
+        "    return;\n");
+
+    int rest = 0;
+    for (int a = 0; a < MEMORY_MAX; ++a)
+    {
+        if (!aot_test(aot_reached, a)) continue;
+        if (aot_test(aot_leader, a))
+        {
+            rest = aot_block_length(vm, a);
+            fprintf(out, "\nL_%04X:\n    ENTER(0x%04X, %d);\n", a, a, rest);
+        }
+        aot_emit_instr(vm, out, a, --rest);
+        if (a == MEMORY_MAX - 1 && aot_falls_through(vm->memory[a])) fprintf(out, "    goto L_0000;\n");
+    }
+    fprintf(out, "}\n");
+
+#ifdef LC3_HOST_MMU
+    mmu_protect(vm, 1);
+#endif
+    return fclose(out) == 0;
+}
+
+#ifdef LC3_AOT
+// Supplied by the file --aot wrote.
+extern const struct aot_segment aot_segments[];
+extern const int aot_segment_count;
+extern const uint8_t aot_code[MEMORY_MAX / 8];
+extern const uint8_t aot_entry[MEMORY_MAX / 8];
+void aot_run(struct vm* vm);
+
+// Kill the label whose block holds a word that was just stored into.
+void aot_invalidate(struct vm* vm, uint16_t address)
+{
+    if (!aot_test(aot_code, address)) return;
+    while (!aot_test(aot_entry, address)) --address;
+    vm->aot_dead[address] = 1;
+    vm->aot_hit = 1;
+}
+
+void aot_load(struct vm* vm)
+{
+    for (int s = 0; s < aot_segment_count; ++s)
+    {
+        memcpy(vm->memory + aot_segments[s].origin, aot_segments[s].words,
+               aot_segments[s].length * sizeof(uint16_t));
+    }
+}
+
+// Runs recompiled code wherever there is a live label for the PC and the
+// interpreter everywhere else, until HALT. Does nothing if an image loaded on
+// top of the recompiled one changed any of its code.
+void run_aot(struct vm* vm)
+{
+    for (int s = 0; s < aot_segment_count; ++s)
+    {
+        for (int i = 0; i < aot_segments[s].length; ++i)
+        {
+            uint16_t a = aot_segments[s].origin + i;
+            if (aot_test(aot_code, a) && vm->memory[a] != aot_segments[s].words[i]) return;
+        }
+    }
+    for (int i = 0; i < MEMORY_MAX / 8; ++i)
+    {
+        vm->code_map[i] |= aot_code[i];
+    }
+
+    while (vm->running)
+    {
+        if (aot_test(aot_entry, vm->reg[R_PC]) && !vm->aot_dead[vm->reg[R_PC]])
+        {
+            uint64_t before = vm->instr_count;
+            aot_run(vm);
+            vm->aot_native += vm->instr_count - before;
+        }
+        else
+        {
+            step(vm);
+            output_poll(vm);
+        }
+    }
+}
+#endif
+
+// VM LIFETIME
+enum { PC_START = 0x3000 }; // starting position
+
+_Atomic uint32_t vm_ids = 0;     // machines may be created on many threads
+
+// A machine with empty memory, ready to run from PC_START on stdin/stdout.
+// Machines are mmap()ed so memory[] starts on a host page: device pages can
+// be protected and shared images mapped over it.
+struct vm* vm_create()
+{
+    void* p = mmap(NULL, sizeof(struct vm), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+    struct vm* vm = p;
+#ifdef LC3_HOST_MMU
+    mmu_register(vm);
+#endif
+    vm->id = atomic_fetch_add(&vm_ids, 1) + 1;
+    vm->clock = 1;
+    vm->input = stdin;
+    vm->output = stdout;
+    vm->output_latency = 0.01;
+    vm->output_check = UINT64_MAX;
+    vm->running = 1;
+    vm->reg[R_COND] = FL_ZRO;
+    load_flags(vm);
+    vm->reg[R_PC] = PC_START;
+    vm_map_device(vm, MR_KBSR, MR_KBDR, keyboard_read, NULL, NULL);
+    return vm;
+}
+
+void vm_destroy(struct vm* vm)
+{
+    output_flush(vm);
+    screen_destroy(vm->screen);
+    free(vm->script);
+    input_stop(vm);
+    uring_stop(vm);
+    free(vm->uring_out);
+    restore_input_buffering(vm);
+    free(vm->decoded);
+    if (vm->block_at)
+    {
+        for (int a = 0; a < MEMORY_MAX; ++a)
+        {
+            free(vm->block_at[a]);
+        }
+        free(vm->block_at);
+    }
+    while (vm->retired_blocks)
+    {
+        struct block* b = vm->retired_blocks;
+        vm->retired_blocks = b->retired;
+        free(b);
+    }
+    if (vm->trace_at) flush_traces(vm);
+    free(vm->trace_at);
+    free(vm->trace_hot);
+    free(vm->trace_fails);
+#ifdef LC3_JIT
+    if (vm->jit_code) munmap(vm->jit_code, JIT_CODE_SIZE);
+#endif
+    free(vm->jit_entry_at);
+#ifdef LC3_HOST_MMU
+    mmu_unregister(vm);
+#endif
+    munmap(vm, sizeof(struct vm));
+}
+
+// MEMORY BACKING
+// memory[] is anonymous mmap()ed memory, so it is sparse as it stands: a
+// host page of it costs nothing until the guest writes there, and untouched
+// pages read as zero from the host's shared zero page. vm_populate() makes a
+// machine flat instead, faulting all of memory in up front so no guest access
+// ever waits on the kernel. vm_trim() gives back pages the guest has zeroed.
+enum { MEMORY_SPARSE = 0, MEMORY_FLAT };
+
+void vm_populate(struct vm* vm)
+{
+    size_t step = (size_t)sysconf(_SC_PAGESIZE) / sizeof(uint16_t);
+#ifdef LC3_HOST_MMU
+    mmu_protect(vm, 0);
+#endif
+    for (size_t a = 0; a < MEMORY_MAX; a += step)
+    {
+        volatile uint16_t* word = &vm->memory[a];
+        *word = *word;
+    }
+#ifdef LC3_HOST_MMU
+    mmu_protect(vm, 1);
+#endif
+}
+
+// Returns the bytes handed back.
+size_t vm_trim(struct vm* vm)
+{
+    if (vm->image_mapped) return 0;     // dropped pages would read as the image again
+    size_t step = (size_t)sysconf(_SC_PAGESIZE) / sizeof(uint16_t);
+    size_t released = 0;
+    for (size_t base = 0; base < MEMORY_MAX; base += step)
+    {
+        int keep = 0;
+        for (size_t a = base; a < base + step && !keep; a += 1 << PAGE_BITS)
+        {
+            keep = vm->device_page[a >> PAGE_BITS];
+        }
+        for (size_t a = base; a < base + step && !keep; ++a)
+        {
+            keep = vm->memory[a] != 0;
+        }
+        if (!keep && madvise(vm->memory + base, step * sizeof(uint16_t), MADV_DONTNEED) == 0)
+        {
+            released += step * sizeof(uint16_t);
+        }
+    }
+    return released;
+}
+
+// SHARED IMAGES
+// Many machines running the same program can share one copy of its memory.
+// image_create() loads the images once into a memfd; vm_map_image() maps it
+// MAP_PRIVATE over a machine's memory[], so the host keeps a single physical
+// copy of every page until some machine writes to it.
+#ifdef __linux__
+// Returns the image descriptor, or -1.
+int image_create(const char* const* images, int count)
+{
+    struct vm* scratch = vm_create();
+    if (!scratch) return -1;
+    int fd = -1;
+    if (read_images(scratch, images, count) == count)
+    {
+        fd = memfd_create("lc3-image", MFD_CLOEXEC);
+#ifdef LC3_HOST_MMU
+        mmu_protect(scratch, 0);
+#endif
+        if (fd >= 0 && write(fd, scratch->memory, sizeof(scratch->memory)) != sizeof(scratch->memory))
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    vm_destroy(scratch);
+    return fd;
+}
+
+// Replace the machine's memory with the image; map before running.
+int vm_map_image(struct vm* vm, int image)
+{
+    if (mmap(vm->memory, sizeof(vm->memory), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, image, 0) == MAP_FAILED)
+    {
+        return 0;
+    }
+    for (int page = 0; page < PAGE_COUNT; ++page)
+    {
+        vm->page_stamp[page] = vm->clock;
+    }
+    vm->image_mapped = 1;
+#ifdef LC3_HOST_MMU
+    mmu_protect(vm, 1);
+#endif
+    return 1;
+}
+
+// Resident bytes of the machine (not counting engine caches), split into its
+// own pages and pages it shares: a mapped image's pages nobody has written
+// yet, or the zero page behind memory it has only read.
+void vm_resident(struct vm* vm, size_t* own, size_t* shared)
+{
+    *own = 0;
+    *shared = 0;
+    long page = sysconf(_SC_PAGESIZE);
+    uintptr_t first = (uintptr_t)vm / page;
+    size_t count = ((uintptr_t)vm + sizeof(struct vm) - 1) / page - first + 1;
+    uint64_t* entries = malloc(count * sizeof(uint64_t));
+    int fd = open("/proc/self/pagemap", O_RDONLY);
+    if (entries && fd >= 0
+        && pread(fd, entries, count * sizeof(uint64_t), first * sizeof(uint64_t)) == (ssize_t)(count * sizeof(uint64_t)))
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (!(entries[i] >> 63 & 1)) continue;      // not present
+            if ((entries[i] >> 61 & 1) || !(entries[i] >> 56 & 1)) *shared += page;
+            else *own += page;      // anonymous and mapped only here
+        }
+    }
+    if (fd >= 0) close(fd);
+    free(entries);
+}
+#endif
+
+// CLONING
+// Overwrite one page, dropping whatever was translated from words that
+// change.
+void load_page(struct vm* vm, int page, const uint16_t* words)
+{
+    uint16_t first = page << PAGE_BITS;
+    uint16_t* to = vm->memory + first;
+    for (int i = 0; i < (1 << PAGE_BITS) / 8; ++i)
+    {
+        if (!vm->code_map[(first >> 3) + i]) continue;
+        for (int a = i * 8; a < i * 8 + 8; ++a)
+        {
+            if (to[a] != words[a]) invalidate_code(vm, first + a);
+        }
+    }
+    memcpy(to, words, sizeof(uint16_t) << PAGE_BITS);
+    vm->page_stamp[page] = vm->clock;
+}
+
+// Make child a copy of parent between runs, halted or not; the two then run
+// independently. When child was last cloned from the same parent,
+// only the pages either of them has written since are copied, and the
+// child's code caches stay warm for everything else.
+void vm_clone_into(struct vm* child, struct vm* parent)
+{
+#ifdef LC3_HOST_MMU
+    mmu_protect(child, 0);
+    mmu_protect(parent, 0);
+#endif
+    int incremental = child->parent_id == parent->id;
+    for (int page = 0; page < PAGE_COUNT; ++page)
+    {
+        if (!incremental
+            || parent->page_stamp[page] > child->parent_clock
+            || child->page_stamp[page] >= child->clone_clock
+            || parent->device_page[page] || child->device_page[page])
+        {
+            load_page(child, page, parent->memory + (page << PAGE_BITS));
+        }
+    }
+
+    memcpy(child->reg, parent->reg, sizeof(parent->reg));
+    child->cond_result = parent->cond_result;
+    child->running = parent->running;
+    child->instr_count = parent->instr_count;
+    child->input = parent->input;
+    child->output = parent->output;
+    memcpy(child->device_page, parent->device_page, sizeof(parent->device_page));
+    memcpy(child->devices, parent->devices, sizeof(parent->devices));
+    child->device_count = parent->device_count;
+    if (child->script != parent->script)
+    {
+        free(child->script);
+        child->script = NULL;
+        size_t size = parent->script_length * sizeof(struct script_key);
+        if (parent->script && (child->script = malloc(size))) memcpy(child->script, parent->script, size);
+    }
+    child->script_length = child->script ? parent->script_length : 0;
+    child->script_next = parent->script_next;
+    child->script_due = parent->script_due;
+#ifdef LC3_AOT
+    for (int a = 0; a < MEMORY_MAX; ++a)
+    {
+        child->aot_dead[a] |= parent->aot_dead[a];
+    }
+#endif
+
+    // Stores from here on get newer stamps on both sides.
+    child->parent_id = parent->id;
+    child->parent_clock = parent->clock++;
+    child->clone_clock = ++child->clock;
+#ifdef LC3_HOST_MMU
+    mmu_protect(parent, 1);
+    mmu_protect(child, 1);
+#endif
+}
+
+struct vm* vm_clone(struct vm* parent)
+{
+    struct vm* child = vm_create();
+    if (child) vm_clone_into(child, parent);
+    return child;
+}
+
+// ENGINE SELECTION
+enum
+{
+    ENGINE_SWITCH = 0,
+    ENGINE_THREADED,
+    ENGINE_DECODED,
+    ENGINE_BLOCK,
+    ENGINE_JIT,
+    ENGINE_TRACE,
+    ENGINE_PROFILE,
+    ENGINE_TABLE
+};
+
+const char* engine_names[] = { "switch", "threaded", "decoded", "block", "jit", "trace", "profile", "table" };
+
+int parse_engine(const char* name)
+{
+    for (int i = 0; i < (int)(sizeof(engine_names) / sizeof(engine_names[0])); ++i)
+    {
+        if (strcmp(name, engine_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+void run_engine(struct vm* vm, int engine)
+{
+#ifdef LC3_AOT
+    run_aot(vm);  // returns early only if an image loaded on top changed its code
+#endif
+    switch (engine)
+    {
+        case ENGINE_THREADED: run_threaded(vm); break;
+        case ENGINE_DECODED:  run_decoded(vm);  break;
+        case ENGINE_BLOCK:    run_blocks(vm);   break;
+        case ENGINE_JIT:      run_jit(vm);      break;
+        case ENGINE_TRACE:    run_trace(vm);    break;
+        case ENGINE_PROFILE:  run_profile(vm);  break;
+        case ENGINE_TABLE:    run_table(vm);    break;
+        default:              run_switch(vm);   break;
+    }
+    materialize_flags(vm);
+}
+
+void print_stats(struct vm* vm, int engine, double seconds)
+{
+#ifdef LC3_AOT
+    const char* name = "aot";
+    (void)engine;
+#else
+    const char* name = engine_names[engine];
+#endif
+    fprintf(stderr, "engine: %s, instructions: %llu, time: %.3f s, MIPS: %.1f\n",
+            name, (unsigned long long)vm->instr_count, seconds,
+            seconds > 0 ? vm->instr_count / seconds / 1e6 : 0.0);
+#ifdef LC3_AOT
+    fprintf(stderr, "recompiled: %llu, interpreted: %llu\n",
+            (unsigned long long)vm->aot_native, (unsigned long long)(vm->instr_count - vm->aot_native));
+#endif
+    fprintf(stderr, "input: %s, %llu system calls (%.1f/s)\n",
+            vm->script ? "script" : vm->uring ? "io_uring" : vm->input_threaded ? "thread" : "direct",
+            (unsigned long long)vm->input_syscalls, seconds > 0 ? vm->input_syscalls / seconds : 0.0);
+    fprintf(stderr, "idle: %llu waits for a key\n", (unsigned long long)vm->idle_waits);
+    fprintf(stderr, "output: %llu system calls (%.1f/s)\n",
+            (unsigned long long)vm->output_syscalls, seconds > 0 ? vm->output_syscalls / seconds : 0.0);
+    if (vm->screen)
+    {
+        fprintf(stderr, "terminal: %llu bytes from the guest, %llu written\n",
+                (unsigned long long)vm->screen->bytes_in, (unsigned long long)vm->screen->bytes_out);
+    }
+#ifdef __linux__
+    size_t own, shared;
+    vm_resident(vm, &own, &shared);
+    fprintf(stderr, "resident: %zu KB own, %zu KB shared\n", own >> 10, shared >> 10);
+#endif
+}
+
+// Run copies of a scripted machine to the end of the script and report each
+// run; the same output hash every time shows the runs went the same way.
+void bench_script(struct vm* vm, int engine, int runs)
+{
+    for (int r = 1; r <= runs; ++r)
+    {
+        struct vm* run = vm_clone(vm);
+        char* text = NULL;
+        size_t size = 0;
+        FILE* output = open_memstream(&text, &size);
+        if (!run || !output)
+        {
+            printf("out of memory\n");
+            exit(1);
+        }
+        run->output = output;
+        run->output_latency = vm->output_latency;
+
+        double start = now_seconds();
+        run_engine(run, engine);
+        double seconds = now_seconds() - start;
+        uint64_t instructions = run->instr_count - vm->instr_count;
+        vm_destroy(run);
+        fclose(output);
+
+        uint64_t hash = 0xCBF29CE484222325ull;      // FNV-1a
+        for (size_t i = 0; i < size; ++i)
+        {
+            hash = (hash ^ (uint8_t)text[i]) * 0x100000001B3ull;
+        }
+        free(text);
+        fprintf(stderr, "run %d: instructions: %llu, time: %.3f s, MIPS: %.1f, output: %zu bytes, hash %016llx\n",
+                r, (unsigned long long)instructions, seconds, seconds > 0 ? instructions / seconds / 1e6 : 0.0,
+                size, (unsigned long long)hash);
+    }
+}
+
+// Cold start: create a machine, load the images and throw it away, over and
+// over; once through read_images() and once through stdio for comparison.
+void bench_load(const char* const* images, int count, int runs)
+{
+    double start = now_seconds();
+    for (int r = 0; r < runs; ++r)
+    {
+        struct vm* vm = vm_create();
+        if (read_images(vm, images, count) < count) runs = r;
+        vm_destroy(vm);
+    }
+    double loaded = now_seconds() - start;
+
+    start = now_seconds();
+    for (int r = 0; r < runs; ++r)
+    {
+        struct vm* vm = vm_create();
+        for (int i = 0; i < count; ++i)
+        {
+            FILE* file = fopen(images[i], "rb");
+            if (!file) continue;
+            read_image_file(vm, file);
+            fclose(file);
+        }
+        vm_destroy(vm);
+    }
+    double streamed = now_seconds() - start;
+
+    if (runs == 0) runs = 1;
+    fprintf(stderr, "load: %d runs of %d image(s), read: %.2f us, stdio: %.2f us per run\n",
+        runs, count, loaded * 1e6 / runs, streamed * 1e6 / runs);
+}
+
+#ifdef __linux__
+// Proportional set size of the whole process: shared pages are split
+// between everything mapping them.
+size_t process_pss()
+{
+    FILE* file = fopen("/proc/self/smaps_rollup", "r");
+    if (!file) return 0;
+    char line[256];
+    size_t kb = 0;
+    while (fgets(line, sizeof(line), file))
+    {
+        if (sscanf(line, "Pss: %zu kB", &kb) == 1) break;
+    }
+    fclose(file);
+    return kb << 10;
+}
+
+// Density: n machines holding the images, first each loading its own copy,
+// then all mapping one shared image. Every machine reads all of its memory,
+// as a long session might; prints what each keeps resident.
+void bench_instances(const char* const* images, int count, int n, int memory)
+{
+    struct vm** vms = calloc(n, sizeof(struct vm*));
+    int image = image_create(images, count);
+    if (!vms || image < 0) return;
+
+    for (int mapped = 0; mapped < 2; ++mapped)
+    {
+        size_t before = process_pss();
+        int made = 0;
+        while (made < n && (vms[made] = vm_create()))
+        {
+            if (memory == MEMORY_FLAT && !mapped) vm_populate(vms[made]);
+            int ok = mapped ? vm_map_image(vms[made], image) : read_images(vms[made], images, count) == count;
+            if (!ok) vm_destroy(vms[made]);
+            if (!ok) break;
+            uint16_t sum = 0;
+            for (int a = 0; a < MEMORY_MAX; a += 1 << PAGE_BITS)
+            {
+                if (!vms[made]->device_page[a >> PAGE_BITS]) sum += *(volatile uint16_t*)&vms[made]->memory[a];
+            }
+            vms[made]->reg[R_R0] = sum;
+            ++made;
+        }
+        size_t pss = process_pss() - before;
+
+        size_t own = 0, shared = 0;
+        for (int i = 0; i < made; ++i)
+        {
+            size_t o, s;
+            vm_resident(vms[i], &o, &s);
+            own += o;
+            shared += s;
+            vm_destroy(vms[i]);
+        }
+        if (made == 0) made = 1;
+        fprintf(stderr, "%s: %d machines, each %.1f KB own and %.1f KB shared resident, %.1f KB PSS\n",
+            mapped ? "shared image" : "own copy", made, own / 1024.0 / made, shared / 1024.0 / made,
+            pss / 1024.0 / made);
+    }
+    close(image);
+    free(vms);
+}
+#endif
+
+// CHECKPOINTS
+// A checkpoint file is a series of records, each the registers plus the pages
+// written since the previous record; the first record holds every page.
+// Restoring replays them all. Records are appended and flushed whole; a torn
+// one at the end (from a crash mid-write) is cut off by the restore, so the
+// next record lands after the last whole one. Words are in host byte order.
+#define CHECKPOINT_MAGIC 0x4B433343u     // "C3CK"
+
+struct checkpoint_header
+{
+    uint32_t magic;
+    uint16_t reg[R_COUNT];
+    uint16_t pages;                     // checkpoint_page records that follow
+    uint64_t instr_count;
+};
+
+struct checkpoint_page
+{
+    uint16_t page;
+    uint16_t words[1 << PAGE_BITS];
+};
+
+// Append a record to vm->checkpoint. Returns 0 if it could not be written.
+int vm_checkpoint(struct vm* vm)
+{
+    struct checkpoint_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = CHECKPOINT_MAGIC;
+    materialize_flags(vm);
+    memcpy(header.reg, vm->reg, sizeof(vm->reg));
+    header.instr_count = vm->instr_count;
+    for (int page = 0; page < PAGE_COUNT; ++page)
+    {
+        header.pages += vm->page_stamp[page] >= vm->checkpoint_clock;
+    }
+
+#ifdef LC3_HOST_MMU
+    mmu_protect(vm, 0);
+#endif
+    int ok = fwrite(&header, sizeof(header), 1, vm->checkpoint) == 1;
+    for (int page = 0; page < PAGE_COUNT && ok; ++page)
+    {
+        if (vm->page_stamp[page] < vm->checkpoint_clock) continue;
+        struct checkpoint_page record;
+        record.page = page;
+        memcpy(record.words, vm->memory + (page << PAGE_BITS), sizeof(record.words));
+        ok = fwrite(&record, sizeof(record), 1, vm->checkpoint) == 1;
+    }
+#ifdef LC3_HOST_MMU
+    mmu_protect(vm, 1);
+#endif
+    ok = fflush(vm->checkpoint) == 0 && ok;
+
+    if (ok) vm->checkpoint_clock = ++vm->clock;
+    return ok;
+}
+
+// Replay every whole record in vm->checkpoint. Returns how many there were.
+int vm_restore(struct vm* vm)
+{
+    struct checkpoint_page* pages = malloc(PAGE_COUNT * sizeof(struct checkpoint_page));
+    if (!pages) return 0;
+    rewind(vm->checkpoint);
+
+    int records = 0;
+    long end = 0;       // of the last whole record
+    struct checkpoint_header header;
+    while (fread(&header, sizeof(header), 1, vm->checkpoint) == 1
+        && header.magic == CHECKPOINT_MAGIC && header.pages <= PAGE_COUNT
+        && fread(pages, sizeof(struct checkpoint_page), header.pages, vm->checkpoint) == header.pages)
+    {
+#ifdef LC3_HOST_MMU
+        mmu_protect(vm, 0);
+#endif
+        for (int i = 0; i < header.pages; ++i)
+        {
+            load_page(vm, pages[i].page & (PAGE_COUNT - 1), pages[i].words);
+        }
+#ifdef LC3_HOST_MMU
+        mmu_protect(vm, 1);
+#endif
+        memcpy(vm->reg, header.reg, sizeof(vm->reg));
+        load_flags(vm);
+        vm->instr_count = header.instr_count;
+        vm->running = 1;
+        ++records;
+        end = ftell(vm->checkpoint);
+    }
+    free(pages);
+    fseek(vm->checkpoint, end, SEEK_SET);
+    if (ftruncate(fileno(vm->checkpoint), end) != 0) return 0;
+
+    // The file now matches memory; further records only need what changes.
+    if (records) vm->checkpoint_clock = ++vm->clock;
+    return records;
+}
+
+// Called after every trap, where all engines have the machine state in vm.
+void checkpoint_tick(struct vm* vm)
+{
+    double now = now_seconds();
+    if (now < vm->checkpoint_due) return;
+    vm_checkpoint(vm);
+    vm->checkpoint_due = now + vm->checkpoint_interval;
+}
+
+// MAIN
+int main(int argc, const char* argv[])
+{
+    int engine = ENGINE_SWITCH;
+    int stats = 0;
+    int images = 0;
+    const char** image_paths = calloc(argc, sizeof(const char*));
+    int image_count = 0;
+    const char* aot_path = NULL;
+    const char* checkpoint_path = NULL;
+    double checkpoint_interval = 5;
+    int load_runs = 0;
+    int shared_image = 0;
+    int instances = 0;
+    int memory = MEMORY_SPARSE;
+    int input_thread = -1;          // on a terminal only, by default
+    int uring = 0;
+    double output_latency = -1;
+    int headless = 0;
+    int terminal = 0;
+    int terminal_cols = 0;
+    int terminal_rows = 0;
+    const char* script_path = NULL;
+    int script_runs = 0;
+    const char* input_path = NULL;
+    const char* output_path = NULL;
+
+    struct vm* vm = vm_create();
+    if (!vm || !image_paths)
+    {
+        printf("out of memory\n");
+        exit(1);
+    }
+
+#ifdef LC3_AOT
+    aot_load(vm);
+    images = 1;     // more images may still be loaded on top
+#endif
+
+    // LOAD ARGUMENT
+    for (int j = 1; j < argc; ++j)
+    {
+        if (strncmp(argv[j], "--engine=", 9) == 0)
+        {
+            engine = parse_engine(argv[j] + 9);
+            if (engine < 0)
+            {
+                printf("unknown engine: %s\n", argv[j] + 9);
+                exit(2);
+            }
+        }
+        else if (strcmp(argv[j], "--stats") == 0)
+        {
+            stats = 1;
+        }
+        else if (strncmp(argv[j], "--aot=", 6) == 0)
+        {
+            aot_path = argv[j] + 6;
+        }
+        else if (strncmp(argv[j], "--checkpoint=", 13) == 0)
+        {
+            checkpoint_path = argv[j] + 13;
+        }
+        else if (strncmp(argv[j], "--checkpoint-interval=", 22) == 0)
+        {
+            checkpoint_interval = atof(argv[j] + 22);
+        }
+        else if (strcmp(argv[j], "--memory=flat") == 0)
+        {
+            memory = MEMORY_FLAT;
+        }
+        else if (strcmp(argv[j], "--memory=sparse") == 0)
+        {
+            memory = MEMORY_SPARSE;
+        }
+        else if (strcmp(argv[j], "--input=thread") == 0)
+        {
+            input_thread = 1;
+            uring = 0;
+        }
+        else if (strcmp(argv[j], "--input=direct") == 0)
+        {
+            input_thread = 0;
+            uring = 0;
+        }
+        else if (strcmp(argv[j], "--input=uring") == 0)
+        {
+            input_thread = -1;      // if there is no io_uring
+            uring = 1;
+        }
+        else if (strncmp(argv[j], "--script=", 9) == 0)
+        {
+            script_path = argv[j] + 9;
+        }
+        else if (strncmp(argv[j], "--script-runs=", 14) == 0)
+        {
+            script_runs = atoi(argv[j] + 14);
+        }
+        else if (strcmp(argv[j], "--terminal") == 0)
+        {
+            terminal = 1;
+        }
+        else if (strncmp(argv[j], "--terminal=", 11) == 0)
+        {
+            terminal = sscanf(argv[j] + 11, "%dx%d", &terminal_cols, &terminal_rows) == 2
+                       && terminal_cols > 0 && terminal_rows > 0;
+            if (!terminal)
+            {
+                printf("bad terminal size: %s\n", argv[j] + 11);
+                exit(2);
+            }
+        }
+        else if (strcmp(argv[j], "--headless") == 0)
+        {
+            headless = 1;
+        }
+        else if (strncmp(argv[j], "--input-file=", 13) == 0)
+        {
+            input_path = argv[j] + 13;
+        }
+        else if (strncmp(argv[j], "--output-file=", 14) == 0)
+        {
+            output_path = argv[j] + 14;
+        }
+        else if (strncmp(argv[j], "--output-latency=", 17) == 0)
+        {
+            output_latency = atof(argv[j] + 17) / 1000;
+        }
+        else if (strncmp(argv[j], "--bench-load=", 13) == 0)
+        {
+            load_runs = atoi(argv[j] + 13);
+        }
+#ifdef __linux__
+        else if (strcmp(argv[j], "--shared-image") == 0)
+        {
+            shared_image = 1;
+        }
+        else if (strncmp(argv[j], "--bench-instances=", 18) == 0)
+        {
+            instances = atoi(argv[j] + 18);
+        }
+#endif
+        else
+        {
+            image_paths[image_count++] = argv[j];
+        }
+    }
+    if (load_runs > 0)
+    {
+        bench_load(image_paths, image_count, load_runs);
+        return 0;
+    }
+#ifdef __linux__
+    if (instances > 0)
+    {
+        bench_instances(image_paths, image_count, instances, memory);
+        return 0;
+    }
+    if (shared_image && image_count > 0)
+    {
+        int image = image_create(image_paths, image_count);
+        if (image < 0 || !vm_map_image(vm, image))
+        {
+            printf("failed to map a shared image\n");
+            exit(1);
+        }
+        close(image);
+        image_count = 0;
+        ++images;
+    }
+#endif
+
+    if (memory == MEMORY_FLAT && !shared_image) vm_populate(vm);
+    int loaded = read_images(vm, image_paths, image_count);
+    if (loaded < image_count)
+    {
+        printf("failed to load image: %s\n", image_paths[loaded]);
+        exit(1);
+    }
+    images += loaded;
+    free(image_paths);
+
+    // A checkpoint resumes the session, whatever the images held.
+    if (checkpoint_path)
+    {
+        vm->checkpoint = fopen(checkpoint_path, "a+b");
+        if (!vm->checkpoint)
+        {
+            printf("failed to open checkpoint: %s\n", checkpoint_path);
+            exit(1);
+        }
+        if (vm_restore(vm)) ++images;
+    }
+    if (images == 0)
+    {
+        printf("./lc3-vm [--engine=switch|threaded|decoded|block|jit|trace|profile|table] [--stats] [--aot=out.c] [--checkpoint=file] [--checkpoint-interval=seconds] [--bench-load=runs] [--memory=flat|sparse] [--input=thread|direct|uring] [--output-latency=ms] [--headless] [--terminal[=colsxrows]] [--script=file] [--script-runs=n] [--input-file=file] [--output-file=file] [--shared-image] [--bench-instances=n] [image-file1] ...\n");
+        exit(2);
+    }
+    if (script_path && !vm_load_script(vm, script_path))
+    {
+        printf("failed to load script: %s\n", script_path);
+        exit(1);
+    }
+    if (output_latency >= 0) vm->output_latency = output_latency;
+    if (script_runs > 0 && vm->script)
+    {
+        bench_script(vm, engine, script_runs);
+        vm_destroy(vm);
+        return 0;
+    }
+    if (aot_path)
+    {
+        if (!aot_emit(vm, aot_path, PC_START))
+        {
+            printf("failed to write: %s\n", aot_path);
+            exit(1);
+        }
+        return 0;
+    }
+
+    if (input_path && !(vm->input = fopen(input_path, "rb")))
+    {
+        printf("failed to open input: %s\n", input_path);
+        exit(1);
+    }
+    if (output_path && !(vm->output = fopen(output_path, "wb")))
+    {
+        printf("failed to open output: %s\n", output_path);
+        exit(1);
+    }
+    FILE* input = vm->input;
+    FILE* output = vm->output;
+    if (terminal)
+    {
+        struct winsize size;
+        if (terminal_cols == 0 && ioctl(fileno(output), TIOCGWINSZ, &size) == 0 && size.ws_col && size.ws_row)
+        {
+            terminal_cols = size.ws_col;
+            terminal_rows = size.ws_row;
+        }
+        vm->screen = screen_create(terminal_rows ? terminal_rows : 24, terminal_cols ? terminal_cols : 80);
+        if (!vm->screen)
+        {
+            printf("out of memory\n");
+            exit(1);
+        }
+    }
+
+    // SETUP
+    // Headless, the terminal (if there is one) is left as it is, and ^C
+    // just ends the process.
+    if (!headless)
+    {
+        signal(SIGINT, handle_interrupt);
+        disable_input_buffering(vm);
+    }
+    if (uring && !uring_start(vm))
+    {
+        fprintf(stderr, "io_uring is not available, falling back to the default input\n");
+    }
+    // Keys from a file or pipe are there at the first poll; through the
+    // thread they would turn up at whatever poll the read() lands on.
+    if (input_thread < 0) input_thread = !vm->script && isatty(fileno(vm->input));
+    if (vm->uring) input_thread = 0;
+    if (input_thread && !input_start(vm))
+    {
+        printf("failed to start the input thread\n");
+        exit(1);
+    }
+
+    double start = now_seconds();
+    vm->checkpoint_interval = checkpoint_interval;
+    vm->checkpoint_due = start + checkpoint_interval;
+    run_engine(vm, engine);
+    if (stats) print_stats(vm, engine, now_seconds() - start);
+    if (vm->checkpoint)
+    {
+        vm_checkpoint(vm);
+        fclose(vm->checkpoint);
+    }
+
+    vm_destroy(vm);
+    if (input != stdin) fclose(input);
+    if (output != stdout) fclose(output);
+    return 0;
+}
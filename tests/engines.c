@@ -0,0 +1,629 @@
+// MACHINE TESTS
+// Checks of lc3.c from the inside, built and run by tests/run.sh:
+//     engines cross [seeds]       every case on every engine, see CROSS-CHECK
+//     engines machines            cases on many threads at once, see MACHINES
+//     engines devices             device registers on every engine, see DEVICES
+//     engines idle                polling loops that may and may not sleep, see IDLE
+//     engines run CASE ENGINE     one result line
+//     engines emit CASE FILE      recompile CASE to C, see --aot
+// Built with -DLC3_TEST_AOT='"FILE"' it includes the recompiled FILE instead
+// of lc3.c, so "run" goes through it.
+#define main lc3_main
+#ifdef LC3_TEST_AOT
+#include LC3_TEST_AOT
+#else
+#include "../lc3.c"
+#endif
+#undef main
+#include <setjmp.h>
+#include <semaphore.h>
+
+// SELF-MODIFYING CODE
+// Each stores into code that has already run or is about to, in the places
+// the caches care about: a loop head, the second half of a fused pair, the
+// next word of the same block, and a loop hot enough to be traced.
+struct smc_case
+{
+    const char* name;
+    uint16_t r0;                // R0 at HALT
+    uint16_t words[16];         // from 0x3000
+};
+
+const struct smc_case smc_cases[] =
+{
+    // LOOP: ADD R0,R0,#1 is rewritten to ADD R0,R0,#2 after the first pass.
+    { "smc1", '5', { 0x5020, 0x54A0, 0x14A3, 0x1021, 0x2207, 0x33FD, 0x14BF, 0x03FB,
+                     0x2204, 0x1001, 0xF021, 0xF025, 0x1022, 0x0030 } },
+    // The second ADD of ADD R0 / ADD R3 is rewritten to ADD R3,R3,#5.
+    { "smc2", '6', { 0x5020, 0x56E0, 0x54A0, 0x14A2, 0x1021, 0x16E1, 0x2207, 0x33FD,
+                     0x14BF, 0x03FA, 0x2204, 0x10C1, 0xF021, 0xF025, 0x16E5, 0x0030 } },
+    // ST into the very next word: ADD R0,R0,#1 runs as ADD R0,R0,#7.
+    { "smc3", '7', { 0x5020, 0x2206, 0x3200, 0x1021, 0x2204, 0x1001, 0xF021, 0xF025,
+                     0x1027, 0x0030 } },
+    // 300 passes; at pass 151 the loop's ADD R0,R0,#1 becomes #2.
+    { "smc4", 449, { 0x5020, 0x240B, 0x1021, 0x220A, 0x1242, 0x0A02, 0x2208, 0x33FA,
+                     0x14BF, 0x03F8, 0xF025, 0x0000, 0x0000, 0x012C, 0xFF6A, 0x1022 } },
+};
+
+#define SMC_CASES ((int)(sizeof(smc_cases) / sizeof(smc_cases[0])))
+
+// FUZZ
+// Straight-line runs of every non-trap opcode with short forward branches
+// and JSRs, loads and stores into a data area (STI through pointers kept in
+// it), wrapped in a loop that runs the whole program 100 times so block
+// chains and traces get hot.
+#define FUZZ_LENGTH 200
+
+__thread uint32_t fuzz_state;     // MACHINES makes images on many threads
+
+uint32_t fuzz_next()
+{
+    fuzz_state = fuzz_state * 1103515245 + 12345;
+    return fuzz_state >> 8;
+}
+
+void fuzz_image(struct vm* vm, uint32_t seed)
+{
+    fuzz_state = seed;
+    uint16_t code = 0x3000;
+    uint16_t data = code + FUZZ_LENGTH + 8;
+    for (int i = 0; i < 256; ++i)
+    {
+        vm->memory[data + i] = (fuzz_next() & 1) ? data + (fuzz_next() & 0xFF) : fuzz_next();
+    }
+    for (int i = 0; i < FUZZ_LENGTH; ++i)
+    {
+        uint16_t pc = code + i;
+        int dr = fuzz_next() % 8;
+        if (dr == 6) dr = 0;    // R6 points at the data
+        int sr = fuzz_next() % 8;
+        int sr2 = fuzz_next() % 8;
+        int fwd = 1 + fuzz_next() % 8;
+        if (i + fwd >= FUZZ_LENGTH) fwd = FUZZ_LENGTH - i;
+        uint16_t near = (data + (fuzz_next() & 0xFF) - pc - 1) & 0x1FF;
+        uint16_t w;
+        switch (fuzz_next() % 14)
+        {
+            case 0:  w = 0x1000 | dr << 9 | sr << 6 | sr2; break;
+            case 1:  w = 0x1020 | dr << 9 | sr << 6 | (fuzz_next() & 0x1F); break;
+            case 2:  w = 0x5000 | dr << 9 | sr << 6 | sr2; break;
+            case 3:  w = 0x5020 | dr << 9 | sr << 6 | (fuzz_next() & 0x1F); break;
+            case 4:  w = 0x903F | dr << 9 | sr << 6; break;
+            case 5:  w = 0x0000 | (fuzz_next() & 7) << 9 | ((fwd - 1) & 0x1FF); break;
+            case 6:  w = 0x2000 | dr << 9 | near; break;
+            case 7:  w = 0x6000 | dr << 9 | sr << 6 | (fuzz_next() & 0x3F); break;
+            case 8:  w = 0xA000 | dr << 9 | near; break;
+            case 9:  w = 0xE000 | dr << 9 | (fuzz_next() & 0x1FF); break;
+            case 10: w = 0x3000 | sr << 9 | near; break;
+            case 11: w = 0x7000 | sr << 9 | 6 << 6 | (fuzz_next() & 0x1F); break;
+            case 12: w = 0xB000 | sr << 9 | near; break;
+            default: w = 0x4800 | ((fwd - 1) & 0x7FF); break;
+        }
+        vm->memory[pc] = w;
+    }
+    vm->memory[code + FUZZ_LENGTH] = 0x6FBF;        // LDR R7, R6, #-1
+    vm->memory[code + FUZZ_LENGTH + 1] = 0x1FFF;    // ADD R7, R7, #-1
+    vm->memory[code + FUZZ_LENGTH + 2] = 0x7FBF;    // STR R7, R6, #-1
+    vm->memory[code + FUZZ_LENGTH + 3] = 0x0200 | ((-(FUZZ_LENGTH + 4)) & 0x1FF);     // BRp code
+    vm->memory[code + FUZZ_LENGTH + 4] = 0xF025;    // HALT
+    vm->memory[data - 1] = 100;
+    for (int i = 0; i < 8; ++i)
+    {
+        vm->reg[i] = fuzz_next();
+    }
+    vm->reg[R_R6] = data;
+}
+
+// A machine loaded with CASE; NULL if there is no such case.
+struct vm* case_create(const char* name)
+{
+    struct vm* vm = vm_create();
+    if (!vm) return NULL;
+    int found = 0;
+    for (int i = 0; i < SMC_CASES; ++i)
+    {
+        if (strcmp(name, smc_cases[i].name) != 0) continue;
+        memcpy(vm->memory + PC_START, smc_cases[i].words, sizeof(smc_cases[i].words));
+        found = 1;
+    }
+    char* end;
+    unsigned long seed = strtoul(name, &end, 10);
+    if (!found && *name && !*end)
+    {
+        fuzz_image(vm, (uint32_t)seed);
+        found = 1;
+    }
+    if (!found)
+    {
+        vm_destroy(vm);
+        return NULL;
+    }
+    vm->reg[R_COND] = FL_ZRO;
+    load_flags(vm);
+    vm->reg[R_PC] = PC_START;
+    return vm;
+}
+
+// CROSS-CHECK
+// Runs small self-modifying programs and random programs on every engine
+// and compares registers, flags, instruction count, memory and output with
+// the switch interpreter. A CASE is smc1..smc4 or a fuzz seed.
+
+// Run CASE on engine into line; returns R0 at the end, or -1.
+int case_run(const char* name, int engine, char* line, size_t size)
+{
+    struct vm* vm = case_create(name);
+    if (!vm) return -1;
+    char* output = NULL;
+    size_t output_size = 0;
+    FILE* input = fopen("/dev/null", "rb");
+    FILE* screen = open_memstream(&output, &output_size);
+    vm->input = input;
+    vm->output = screen;
+    run_engine(vm, engine);
+    output_flush(vm);
+    fflush(screen);
+
+    uint64_t memory_hash = 14695981039346656037ULL;     // FNV-1a
+    for (int a = 0; a < MEMORY_MAX; ++a)
+    {
+        memory_hash = (memory_hash ^ vm->memory[a]) * 1099511628211ULL;
+    }
+    uint64_t output_hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < output_size; ++i)
+    {
+        output_hash = (output_hash ^ (uint8_t)output[i]) * 1099511628211ULL;
+    }
+    snprintf(line, size,
+             "%04x %04x %04x %04x %04x %04x %04x %04x cond %04x count %llu memory %016llx output %016llx",
+             vm->reg[0], vm->reg[1], vm->reg[2], vm->reg[3], vm->reg[4], vm->reg[5], vm->reg[6],
+             vm->reg[7], vm->reg[R_COND], (unsigned long long)vm->instr_count,
+             (unsigned long long)memory_hash, (unsigned long long)output_hash);
+    int r0 = vm->reg[R_R0];
+    vm_destroy(vm);
+    fclose(input);
+    fclose(screen);
+    free(output);
+    return r0;
+}
+
+int test_cross(int seeds)
+{
+    char line[256];
+    int failures = 0;
+    int cases = 0;
+    for (int c = 0; c < SMC_CASES + seeds; ++c)
+    {
+        char name[16];
+        if (c < SMC_CASES) snprintf(name, sizeof(name), "%s", smc_cases[c].name);
+        else snprintf(name, sizeof(name), "%d", c - SMC_CASES + 1);
+
+        char expect[256];
+        int r0 = case_run(name, ENGINE_SWITCH, expect, sizeof(expect));
+        if (c < SMC_CASES && r0 != smc_cases[c].r0)
+        {
+            printf("%s switch: R0 %04x, expected %04x\n", name, r0, smc_cases[c].r0);
+            ++failures;
+        }
+        for (int e = ENGINE_SWITCH + 1; e <= ENGINE_TABLE; ++e)
+        {
+            if (e == ENGINE_PROFILE) continue;  // the switch engine, printing its counts
+            case_run(name, e, line, sizeof(line));
+            if (strcmp(line, expect) != 0)
+            {
+                printf("%s %s:\n  %s\n  switch:\n  %s\n", name, engine_names[e], line, expect);
+                ++failures;
+            }
+        }
+        ++cases;
+    }
+    printf("cross: %d cases, %d mismatches\n", cases, failures);
+    return failures != 0;
+}
+
+// MACHINES
+// Every engine runs a batch of random cases at once, one machine and thread
+// each, and must give what switch gives for them one at a time. Any state
+// the machines still share shows up as a difference.
+#define MACHINES 16
+
+struct machine_job
+{
+    int engine;
+    char name[16];
+    char line[256];
+};
+
+void* machine_thread(void* arg)
+{
+    struct machine_job* job = arg;
+    case_run(job->name, job->engine, job->line, sizeof(job->line));
+    return NULL;
+}
+
+int test_machines()
+{
+    char expect[MACHINES][256];
+    for (int m = 0; m < MACHINES; ++m)
+    {
+        char name[16];
+        snprintf(name, sizeof(name), "%d", 1000 + m);
+        case_run(name, ENGINE_SWITCH, expect[m], sizeof(expect[m]));
+    }
+
+    int failures = 0;
+    for (int e = ENGINE_SWITCH; e <= ENGINE_TABLE; ++e)
+    {
+        if (e == ENGINE_PROFILE) continue;  // counts pairs in one global table
+        struct machine_job jobs[MACHINES];
+        pthread_t threads[MACHINES];
+        for (int m = 0; m < MACHINES; ++m)
+        {
+            jobs[m].engine = e;
+            snprintf(jobs[m].name, sizeof(jobs[m].name), "%d", 1000 + m);
+            pthread_create(&threads[m], NULL, machine_thread, &jobs[m]);
+        }
+        for (int m = 0; m < MACHINES; ++m)
+        {
+            pthread_join(threads[m], NULL);
+            if (strcmp(jobs[m].line, expect[m]) != 0)
+            {
+                printf("%s %s on a thread:\n  %s\n  alone:\n  %s\n", jobs[m].name, engine_names[e],
+                       jobs[m].line, expect[m]);
+                ++failures;
+            }
+        }
+    }
+    printf("machines: %d machines per engine, %d mismatches\n", MACHINES, failures);
+    return failures != 0;
+}
+
+// DEVICES
+// A guest loop loads from a read device and stores to a write device, on
+// every engine, with a machine per thread. The devices do what a fault
+// handler must not: lock, allocate, print and wipe the vector registers.
+// Then it prints a string whose first word is under the read device too:
+// PUTS reads memory like the other traps, never the device. Under
+// LC3_HOST_MMU a test thread also keeps a vector register live across a load
+// from a device register it makes itself, and a fault the machines don't own
+// reaches the handler installed before them.
+#define DEVICE_LOOPS 200
+
+const uint16_t device_program[] =
+{
+    0x54A0,     // AND R2, R2, #0
+    0x2608,     // LD R3, COUNT
+    0xA208,     // LOOP LDI R1, RDEV
+    0x1481,     // ADD R2, R2, R1
+    0xB407,     // STI R2, WDEV
+    0x16FF,     // ADD R3, R3, #-1
+    0x03FB,     // BRp LOOP
+    0x2005,     // LD R0, TEXT
+    0xF022,     // PUTS
+    0xF025,     // HALT
+    DEVICE_LOOPS,
+    0xFE10,     // RDEV
+    0xFE12,     // WDEV
+    0xFE0C,     // TEXT
+};
+
+const uint16_t device_text[] = { 'a', 'b', 'c', 0 };
+
+struct device_state
+{
+    pthread_mutex_t lock;
+    uint16_t reads;
+    uint64_t written;
+    char scratch[65536];
+};
+
+uint16_t device_test_read(struct vm* vm, void* context, uint16_t address)
+{
+    struct device_state* d = context;
+    (void)vm;
+    (void)address;
+    pthread_mutex_lock(&d->lock);
+    char* line = malloc(64);
+    snprintf(line, 64, "read %d %f", d->reads, (double)d->reads / 3);
+    memset(d->scratch, line[5], sizeof(d->scratch));
+    free(line);
+    uint16_t value = ++d->reads;
+    pthread_mutex_unlock(&d->lock);
+    return value;
+}
+
+void device_test_write(struct vm* vm, void* context, uint16_t address, uint16_t val)
+{
+    struct device_state* d = context;
+    (void)vm;
+    (void)address;
+    pthread_mutex_lock(&d->lock);
+    memset(d->scratch, val, sizeof(d->scratch));
+    d->written += val;
+    pthread_mutex_unlock(&d->lock);
+}
+
+struct device_job
+{
+    int engine;
+    int failures;
+};
+
+void* device_thread(void* arg)
+{
+    struct device_job* job = arg;
+    struct device_state* d = calloc(1, sizeof(struct device_state));
+    pthread_mutex_init(&d->lock, NULL);
+    struct vm* vm = vm_create();
+    memcpy(vm->memory + PC_START, device_program, sizeof(device_program));
+#ifdef LC3_HOST_MMU
+    mmu_protect(vm, 0);
+#endif
+    memcpy(vm->memory + 0xFE0C, device_text, sizeof(device_text));
+#ifdef LC3_HOST_MMU
+    mmu_protect(vm, 1);
+#endif
+    vm_map_device(vm, 0xFE10, 0xFE10, device_test_read, NULL, d);
+    vm_map_device(vm, 0xFE0C, 0xFE0C, device_test_read, NULL, d);
+    vm_map_device(vm, 0xFE12, 0xFE12, NULL, device_test_write, d);
+    char* output = NULL;
+    size_t output_size = 0;
+    FILE* screen = open_memstream(&output, &output_size);
+    vm->output = screen;
+    run_engine(vm, job->engine);
+    output_flush(vm);
+    fflush(screen);
+    if (strcmp(output, "abcShutdown\n") != 0)
+    {
+        printf("devices %s: printed '%s', expected 'abc'\n", engine_names[job->engine], output);
+        ++job->failures;
+    }
+
+    // sum of 1..n, and the sum of those sums
+    uint16_t sum = DEVICE_LOOPS * (DEVICE_LOOPS + 1) / 2;
+    uint64_t sums = (uint64_t)DEVICE_LOOPS * (DEVICE_LOOPS + 1) * (DEVICE_LOOPS + 2) / 6;
+    if (vm->reg[R_R2] != sum || d->reads != DEVICE_LOOPS || d->written != sums)
+    {
+        printf("devices %s: R2 %u, %u reads, %llu written; expected %u, %u, %llu\n",
+               engine_names[job->engine], vm->reg[R_R2], d->reads, (unsigned long long)d->written,
+               sum, DEVICE_LOOPS, (unsigned long long)sums);
+        ++job->failures;
+    }
+#if defined(LC3_HOST_MMU) && defined(__SSE2__)
+    __m128i kept = _mm_set_epi32(0x01234567, 0x89ABCDEF, 0x02468ACE, 0x13579BDF);
+    __asm__ volatile ("" : "+x"(kept));
+    uint16_t read = *(volatile uint16_t*)&vm->memory[0xFE10];
+    __asm__ volatile ("" : "+x"(kept));
+    __m128i same = _mm_cmpeq_epi32(kept, _mm_set_epi32(0x01234567, 0x89ABCDEF, 0x02468ACE, 0x13579BDF));
+    if (read != DEVICE_LOOPS + 1 || _mm_movemask_epi8(same) != 0xFFFF)
+    {
+        printf("devices %s: host load read %u, vector register %s\n", engine_names[job->engine], read,
+               _mm_movemask_epi8(same) == 0xFFFF ? "kept" : "lost");
+        ++job->failures;
+    }
+#endif
+    vm_destroy(vm);
+    fclose(screen);
+    free(output);
+    pthread_mutex_destroy(&d->lock);
+    free(d);
+    return NULL;
+}
+
+#ifdef LC3_HOST_MMU
+sigjmp_buf device_escape;
+
+void device_old_handler(int signal, siginfo_t* info, void* context)
+{
+    (void)signal;
+    (void)info;
+    (void)context;
+    siglongjmp(device_escape, 1);
+}
+
+// Returns 1 if a fault on a page no machine owns reaches the handler.
+int device_chain()
+{
+    volatile uint16_t* guard = mmap(NULL, 4096, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    int chained = sigsetjmp(device_escape, 1);
+    if (!chained) (void)*guard;
+    munmap((void*)guard, 4096);
+    return chained;
+}
+#endif
+
+int test_devices()
+{
+    int failures = 0;
+#ifdef LC3_HOST_MMU
+    struct sigaction sa = { .sa_sigaction = device_old_handler, .sa_flags = SA_SIGINFO };
+    sigaction(SIGSEGV, &sa, NULL);
+#endif
+    for (int e = ENGINE_SWITCH; e <= ENGINE_TABLE; ++e)
+    {
+        if (e == ENGINE_PROFILE) continue;
+        struct device_job jobs[8];
+        pthread_t threads[8];
+        for (int t = 0; t < 8; ++t)
+        {
+            jobs[t].engine = e;
+            jobs[t].failures = 0;
+            pthread_create(&threads[t], NULL, device_thread, &jobs[t]);
+        }
+        for (int t = 0; t < 8; ++t)
+        {
+            pthread_join(threads[t], NULL);
+            failures += jobs[t].failures;
+        }
+    }
+#ifdef LC3_HOST_MMU
+    if (!device_chain())
+    {
+        printf("devices: a fault outside the machines was not passed on\n");
+        ++failures;
+    }
+#endif
+    printf("devices: %d mismatches\n", failures);
+    return failures != 0;
+}
+
+// IDLE
+// KBSR polling loops on every engine, with a keyboard that types a key once
+// the machine sleeps for one, or else key_after seconds in. Two give up after
+// 20000 polls, counting down and counting up, and print T: they must never
+// sleep. The last only counts up a seed between polls, as 2048 does, and
+// must sleep once and print K.
+struct idle_case
+{
+    const char* name;
+    double key_after;
+    const char* output;
+    uint64_t waits;
+    uint16_t words[16];
+};
+
+const struct idle_case idle_cases[] =
+{
+    { "count-down", 2.0, "TShutdown\n", 0,
+      { 0x220B,     // LD R1, COUNT
+        0xA009,     // POLL LDI R0, KBSR
+        0x0805,     // BRn KEY
+        0x127F,     // ADD R1, R1, #-1
+        0x03FC,     // BRp POLL
+        0xE007,     // LEA R0, "T"
+        0xF022,     // PUTS
+        0xF025,     // HALT
+        0xE006,     // KEY LEA R0, "K"
+        0xF022,     // PUTS
+        0xF025,     // HALT
+        0xFE00,     // KBSR
+        20000,      // COUNT
+        'T', 0, 'K' } },
+    { "count-up", 2.0, "TShutdown\n", 0,
+      { 0x220B,     // LD R1, COUNT
+        0xA009,     // POLL LDI R0, KBSR
+        0x0805,     // BRn KEY
+        0x1261,     // ADD R1, R1, #1
+        0x09FC,     // BRn POLL
+        0xE007,     // LEA R0, "T"
+        0xF022,     // PUTS
+        0xF025,     // HALT
+        0xE006,     // KEY LEA R0, "K"
+        0xF022,     // PUTS
+        0xF025,     // HALT
+        0xFE00,     // KBSR
+        0xB1E0,     // COUNT: -20000
+        'T', 0, 'K' } },
+    { "seed", 10.0, "KShutdown\n", 1,
+      { 0x1261,     // SEED ADD R1, R1, #1
+        0xA004,     // LDI R0, KBSR
+        0x07FD,     // BRzp SEED
+        0xE003,     // LEA R0, "K"
+        0xF022,     // PUTS
+        0xF025,     // HALT
+        0xFE00,     // KBSR
+        'K' } },
+};
+
+#define IDLE_CASES ((int)(sizeof(idle_cases) / sizeof(idle_cases[0])))
+
+struct idle_keyboard
+{
+    int fd;
+    struct vm* vm;
+    double key_after;
+    sem_t done;
+};
+
+// Types a key unless the machine finished first.
+void* idle_typist(void* arg)
+{
+    struct idle_keyboard* k = arg;
+    double until = now_seconds() + k->key_after;
+    while (sem_trywait(&k->done) < 0)
+    {
+        if (__atomic_load_n(&k->vm->idle_waits, __ATOMIC_RELAXED) || now_seconds() >= until)
+        {
+            if (write(k->fd, "k", 1) != 1) abort();
+            break;
+        }
+        usleep(1000);
+    }
+    return NULL;
+}
+
+int test_idle()
+{
+    int failures = 0;
+    for (int c = 0; c < IDLE_CASES; ++c)
+    {
+        const struct idle_case* ic = &idle_cases[c];
+        for (int e = ENGINE_SWITCH; e <= ENGINE_TABLE; ++e)
+        {
+            if (e == ENGINE_PROFILE) continue;
+            struct vm* vm = vm_create();
+            memcpy(vm->memory + PC_START, ic->words, sizeof(ic->words));
+            char* output = NULL;
+            size_t output_size = 0;
+            FILE* screen = open_memstream(&output, &output_size);
+            int keys[2];
+            if (pipe(keys) < 0) abort();
+            vm->input = fdopen(keys[0], "rb");
+            vm->output = screen;
+
+            struct idle_keyboard k = { .fd = keys[1], .vm = vm, .key_after = ic->key_after };
+            sem_init(&k.done, 0, 0);
+            pthread_t typist;
+            pthread_create(&typist, NULL, idle_typist, &k);
+            run_engine(vm, e);
+            output_flush(vm);
+            fflush(screen);
+            sem_post(&k.done);
+            pthread_join(typist, NULL);
+
+            if (strcmp(output, ic->output) != 0 || vm->idle_waits != ic->waits)
+            {
+                printf("idle %s %s: printed '%s' after %llu waits, expected '%s' after %llu\n",
+                       ic->name, engine_names[e], output, (unsigned long long)vm->idle_waits,
+                       ic->output, (unsigned long long)ic->waits);
+                ++failures;
+            }
+            fclose(vm->input);
+            vm_destroy(vm);
+            fclose(screen);
+            free(output);
+            close(keys[1]);
+            sem_destroy(&k.done);
+        }
+    }
+    printf("idle: %d mismatches\n", failures);
+    return failures != 0;
+}
+
+int main(int argc, char** argv)
+{
+    char line[256];
+    if (argc == 4 && strcmp(argv[1], "run") == 0)
+    {
+        int engine = parse_engine(argv[3]);
+        if (engine < 0 || case_run(argv[2], engine, line, sizeof(line)) < 0) return 2;
+        printf("%s\n", line);
+        return 0;
+    }
+    if (argc == 4 && strcmp(argv[1], "emit") == 0)
+    {
+        struct vm* vm = case_create(argv[2]);
+        int ok = vm && aot_emit(vm, argv[3], PC_START);
+        if (vm) vm_destroy(vm);
+        return ok ? 0 : 2;
+    }
+    if (argc >= 2 && strcmp(argv[1], "cross") == 0)
+    {
+        return test_cross(argc > 2 ? atoi(argv[2]) : 200);
+    }
+    if (argc == 2 && strcmp(argv[1], "machines") == 0) return test_machines();
+    if (argc == 2 && strcmp(argv[1], "devices") == 0) return test_devices();
+    if (argc == 2 && strcmp(argv[1], "idle") == 0) return test_idle();
+    fprintf(stderr, "usage: engines cross [seeds] | machines | devices | idle | run CASE ENGINE | emit CASE FILE\n");
+    return 2;
+}
@@ -0,0 +1,95 @@
+#!/bin/sh
+# Regression check. Builds lc3-vm and tests/engines.c and runs every check
+# below against them, in every build. Exits nonzero on any mismatch.
+#     tests/run.sh [fuzz seeds]
+set -e
+cd "$(dirname "$0")/.."
+seeds=${1:-200}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+failures=0
+
+fail()
+{
+    echo "FAIL $*"
+    failures=$((failures + 1))
+}
+
+expected()
+{
+    case $1 in
+        2048)  echo "1402173 920b5c0edeb5a221" ;;
+        rogue) echo "6166574 9768689382dc31f6" ;;
+    esac
+}
+
+# Plays GAME's script with BINARY [options] and checks the first run's
+# instruction count and output hash.
+play()
+{
+    name=$1 game=$2 binary=$3
+    shift 3
+    got=$("$binary" "$@" --script=$game.script --script-runs=1 $game.obj </dev/null 2>&1 >/dev/null |
+          sed -n 's/^run 1: instructions: \([0-9]*\),.* hash \([0-9a-f]*\)$/\1 \2/p')
+    if [ "$got" != "$(expected $game)" ]; then
+        fail "$name $game: '$got', expected '$(expected $game)'"
+    fi
+}
+
+for build in plain mmu; do
+    flags=
+    [ $build = mmu ] && flags=-DLC3_HOST_MMU
+    gcc -O2 -pthread $flags lc3.c -o "$dir/lc3-vm-$build"
+    gcc -O2 -pthread $flags tests/engines.c -o "$dir/engines-$build"
+
+    # Both games played to the end on every engine.
+    for engine in switch threaded decoded block jit trace profile table; do
+        for game in 2048 rogue; do
+            play "$build $engine" $game "$dir/lc3-vm-$build" --engine=$engine
+        done
+    done
+
+    # Self-modifying and random programs on every engine, against switch.
+    "$dir/engines-$build" cross $seeds || fail "$build cross"
+
+    # Machines running side by side on threads share nothing.
+    "$dir/engines-$build" machines || fail "$build machines"
+
+    # Device registers reached from every engine, devices that lock and
+    # print, and under LC3_HOST_MMU a host load that faults.
+    "$dir/engines-$build" devices || fail "$build devices"
+
+    # A KBSR loop counting to a timeout runs on; one that only polls sleeps.
+    "$dir/engines-$build" idle || fail "$build idle"
+done
+
+# Recompiled games play the same and never fall back to the interpreter.
+for game in 2048 rogue; do
+    "$dir/lc3-vm-plain" --aot="$dir/$game.c" $game.obj
+    gcc -O2 -pthread -I. "$dir/$game.c" -o "$dir/$game"
+    play aot $game "$dir/$game"
+    "$dir/$game" --stats --script=$game.script $game.obj </dev/null 2>&1 >/dev/null |
+        grep -q "interpreted: 0$" || fail "aot $game: part of it ran interpreted"
+done
+
+# The self-modifying cases and every fifth random one, recompiled; each is a
+# separate C build.
+cases="smc1 smc2 smc3 smc4"
+seed=1
+while [ $seed -le $seeds ]; do
+    cases="$cases $seed"
+    seed=$((seed + 5))
+done
+for case in $cases; do
+    "$dir/engines-plain" emit $case "$dir/case.c"
+    gcc -O1 -pthread -DLC3_TEST_AOT="\"$dir/case.c\"" -I. tests/engines.c -o "$dir/case"
+    want=$("$dir/engines-plain" run $case switch)
+    got=$("$dir/case" run $case switch)
+    [ "$got" = "$want" ] || fail "aot $case:
+  $got
+  switch:
+  $want"
+done
+
+echo "run.sh: $failures failures"
+[ $failures = 0 ]
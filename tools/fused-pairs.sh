@@ -0,0 +1,37 @@
+#!/bin/sh
+# Regenerates the FUSED_PAIRS table in lc3.c. Runs --engine=profile over the
+# committed 2048.script and rogue.script sessions and merges the two top
+# lists by weight: each game counts the same, so a pair's weight is the sum
+# of its two shares, and a pair missing from one game's list adds nothing
+# there. Paste the output over the table.
+#     tools/fused-pairs.sh [lc3-vm] [pairs]
+set -e
+cd "$(dirname "$0")/.."
+vm=$1
+pairs=${2:-10}
+if [ -z "$vm" ]; then
+    vm=$(mktemp -d)/lc3-vm
+    gcc -O2 -pthread lc3.c -o "$vm"
+fi
+
+echo '#define FUSED_PAIRS(X) \'
+for game in 2048 rogue; do
+    "$vm" --engine=profile --script=$game.script $game.obj </dev/null 2>&1 >/dev/null |
+        sed -n "s/^ *X(\([A-Z_]*\), \([A-Z_]*\)) \/\* *\([0-9.]*\)% \*\/.*/$game \1 \2 \3/p"
+done | awk '
+    function cell(s) { return s == "" ? "  -  " : sprintf("%4.1f%%", s) }
+    {
+        pair = $2 ", " $3
+        share[pair, $1] = $4
+        weight[pair] += $4
+    }
+    END {
+        for (pair in weight)
+        {
+            printf "%08.3f\t    %-19s /* %s / %s */\n", weight[pair], "X(" pair ")",
+                   cell(share[pair, "2048"]), cell(share[pair, "rogue"])
+        }
+    }' | sort -r | head -n "$pairs" | cut -f 2 | awk '
+    NR > 1 { print previous " \\" }
+    { previous = $0 }
+    END { print previous }'